@@ -23,11 +23,25 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 
 #define VERSION "1.1 2005-07-27"
 
@@ -35,6 +49,25 @@
 
 #define PI 3.14159265358979
 
+#define SAMPLE_RATE      44100   /* samples per second of rendered audio */
+#define WAVE_AMPLITUDE   32760.0 /* peak value of a rendered 16-bit sample */
+#define WAVE_HEADER_SIZE 44      /* bytes preceding the data chunk's samples */
+#define RF64_HEADER_SIZE 80      /* bytes preceding the samples of an RF64 file, used once they pass 4 GB */
+#define WAVE_HOLE_SIZE   65536   /* silences at least this many bytes long are left as holes in a WAVE file */
+#define WAVE_BLOCK_SIZE  4096    /* granularity at which a WAVE file written to a stream is checked for silence */
+#define WAVE_CACHE_SIZE  67108864 /* most bytes of phrases kept rendered while streaming a WAVE file */
+#define SYNTHESIS_SECONDS_PER_SAMPLE 1.7e-8 /* rough CPU time taken to synthesize a sample, for estimates */
+
+#define RING_BLOCK_SIZE    262144 /* bytes in each block of a streamed WAVE file; a multiple of WAVE_BLOCK_SIZE */
+#define DEFAULT_RING_DEPTH 16     /* blocks the renderer may get ahead of the writer */
+
+#define SONG_MAGIC           "BPLAYSNG" /* first bytes of a compiled song */
+#define SONG_MAGIC_SIZE      8
+#define SONG_VERSION         3          /* bumped whenever the compiled song format changes */
+#define SONG_CHECKSUM_OFFSET 40
+#define SONG_HEADER_SIZE     48         /* bytes preceding a compiled song's frequencies */
+#define SONG_FREQUENCY_SIZE  8
+
 #define MAX_NUMBER_SEQUENCE_LENGTH 5
 
 #define SOUND_HERTZ_LOWEST              32    /* lowest value BASIC allows for the hertz argument of the SOUND statement */
@@ -42,10 +75,16 @@
 #define SOUND_DURATION_TICKS_PER_SECOND 18.2  /* Ticks per second for the duration of the BASIC sound statement */
 #define SOUND_DURATION(SECONDS)         (SECONDS * SOUND_DURATION_TICKS_PER_SECOND)
 
+#define MIDI_DIVISION    480 /* ticks per quarter note (L4) in a MIDI file */
+#define MIDI_VELOCITY    100
+#define MIDI_NOTE(PITCH) ((PITCH) + 23) /* MIDI key of a pitch; O3 C is middle C */
+
 #define CONVERSION_NOT_SELECTED 0
 #define CONVERT_TO_WAVE         1
 #define CONVERT_TO_IC           2
 #define CONVERT_TO_BAS          4
+#define CONVERT_TO_SONG         8
+#define CONVERT_TO_MIDI         16
 
 #define CODE_ERROR          0
 #define CODE_DURATION       1   /*          1 */
@@ -58,6 +97,9 @@
 #define CODE_L4_PER_MINUTE  128 /*   10000000 */
 #define CODE_NOTE           256 /*  100000000 */
 #define CODE_DOTTED_NOTE    512 /* 1000000000 */
+#define CODE_RELATIVE       1024 /*10000000000 */
+#define CODE_EXECUTE        2048 /*100000000000 */
+#define CODE_REPEAT         4096 /*1000000000000 */
 
 #define NOTE_FLAT    1
 #define NOTE_SHARP   2
@@ -94,8 +136,6 @@
 
 const unsigned int power_of_ten[5] = { 1, 10, 100, 1000, 10000 };
 
-#define CEILING(x) (unsigned long)(x + 1.0)
-
 typedef struct tagNote
 {
   int code;
@@ -104,14 +144,317 @@ typedef struct tagNote
   struct tagNote* last;
 } Note;
 
-typedef struct tagFrequency
+typedef struct tagParseState
+{
+  int code;
+  int value;
+  short code_set;
+  short number_sequence_length;
+  int number_sequence[MAX_NUMBER_SEQUENCE_LENGTH];
+  short last_octave;
+  short last_duration;
+  short octave_known;   /* if zero, last_octave is relative to the unknown starting octave */
+  short duration_known; /* if zero, last_duration is unknown */
+} ParseState;
+
+#define SEMITONE_C      0
+#define SEMITONE_CSHARP 1
+#define SEMITONE_D      2
+#define SEMITONE_EFLAT  3
+#define SEMITONE_E      4
+#define SEMITONE_F      5
+#define SEMITONE_FSHARP 6
+#define SEMITONE_G      7
+#define SEMITONE_AFLAT  8
+#define SEMITONE_A      9
+#define SEMITONE_BFLAT  10
+#define SEMITONE_B      11
+
+#define PITCH_SILENCE           0
+#define PITCH(OCTAVE, SEMITONE) (1 + (OCTAVE) * 12 + (SEMITONE))
+#define NUM_PITCHES             (PITCH(6, SEMITONE_B) + 1)
+
+/**
+ * Frequency of each pitch, filled in by initPitches()
+ */
+double pitch_hertz[NUM_PITCHES];
+
+/**
+ * A frequency is packed into 64 bits: the pitch, as an index into
+ * pitch_hertz, in the top 8 bits and the exact duration, in samples
+ * at SAMPLE_RATE, in the low 56 bits.
+ */
+typedef unsigned long long Frequency;
+
+#define FREQUENCY(PITCH, SAMPLES) (((Frequency)(PITCH) << 56) | (Frequency)(SAMPLES))
+#define FREQUENCY_PITCH(FREQUENCY)   ((unsigned int)((FREQUENCY) >> 56))
+#define FREQUENCY_SAMPLES(FREQUENCY) ((FREQUENCY) & 0x00ffffffffffffffULL)
+#define FREQUENCY_HERTZ(FREQUENCY)   (pitch_hertz[FREQUENCY_PITCH(FREQUENCY)])
+
+typedef struct tagMusicState
+{
+  short octave;
+  unsigned long duration;
+  unsigned long l4_per_minute;
+  int music_code;
+  unsigned int pitch;  /* pitch of the last note, which a note without a pitch repeats */
+  short last_octave;   /* octave and note length as last set by the PLAY statement, */
+  short last_duration; /* before clamping; relative notes are resolved against these */
+} MusicState;
+
+#define PITCH_PHRASE 0xff /* pitch of a reference to a phrase */
+#define PITCH_TEMPO  0xfe /* pitch of a change of tempo, which lasts no samples */
+
+#define TEMPO_CHANGE(L4_PER_MINUTE)   FREQUENCY(PITCH_TEMPO, L4_PER_MINUTE)
+#define FREQUENCY_IS_TEMPO(FREQUENCY) (FREQUENCY_PITCH(FREQUENCY) == PITCH_TEMPO)
+#define TEMPO_L4_PER_MINUTE(FREQUENCY) ((unsigned long)FREQUENCY_SAMPLES(FREQUENCY))
+
+#define PHRASE_REFERENCE(INDEX, COUNT) FREQUENCY(PITCH_PHRASE, ((Frequency)(COUNT) << 24) | (INDEX))
+#define FREQUENCY_IS_PHRASE(FREQUENCY) (FREQUENCY_PITCH(FREQUENCY) == PITCH_PHRASE)
+#define PHRASE_INDEX(FREQUENCY)        ((unsigned long)((FREQUENCY) & 0xffffff))
+#define PHRASE_COUNT(FREQUENCY)        ((unsigned long)(FREQUENCY_SAMPLES(FREQUENCY) >> 24))
+#define MAX_PHRASES                    0x1000000
+#define MAX_SONG_SAMPLES               0x00ffffffffffffffULL /* longest a song or phrase may play, counting repetitions */
+
+/**
+ * A song is the array of frequencies a PLAY statement converts to.
+ * A frequency may instead refer to a phrase: the frequencies of a
+ * sub-string executed with X, played a number of times.  Each phrase
+ * is itself a song, stored once in the phrases of the outermost song.
+ * A frequency may also mark a change of tempo, which only matters to
+ * formats that keep the tempo, such as MIDI.
+ */
+typedef struct tagSong
+{
+  Frequency* frequencies;
+  unsigned long num_frequencies;
+  unsigned long capacity;      /* allocated length of frequencies */
+  unsigned long long total_samples; /* samples spanned by all frequencies, counting repetitions */
+  struct tagSong* phrases;
+  unsigned long num_phrases;
+  unsigned long phrase_capacity;
+  int substring;               /* for a phrase, the sub-string it was played from, */
+  MusicState start;            /* the music state it was played from, */
+  MusicState end;              /* and the music state after it */
+  void* mapping;               /* if set, frequencies point into this mapped compiled song */
+  size_t mapping_size;
+  unsigned long long* timeline; /* built by songTimeline() when first needed */
+  unsigned long* phrase_slots; /* hash table of the phrases by sub-string and start state: index + 1, or 0 */
+  unsigned long phrase_slot_capacity;
+  unsigned long num_indexed_phrases;
+} Song;
+
+/**
+ * A named sub-string that can be executed from a PLAY statement with
+ * the X command.
+ */
+typedef struct tagSubstring
+{
+  char* name;
+  char* play;
+  Note* notes;
+  ParseState state;            /* parse state after the sub-string, relative to the state before it */
+  unsigned long num_notes;
+  short status;
+} Substring;
+
+#define SUBSTRING_UNPARSED 0
+#define SUBSTRING_PARSING  1
+#define SUBSTRING_PARSED   2
+
+Substring* substrings = NULL;
+unsigned int num_substrings = 0;
+
+#define FREQUENCY_SECONDS(FREQUENCY) ((double)FREQUENCY_SAMPLES(FREQUENCY) / (double)SAMPLE_RATE)
+
+#define MAX_LOOP_LENGTH  32    /* longest run of events always tried as the body of a loop */
+#define LOOP_WINDOW      8     /* events compared to find longer loops */
+#define MAX_CODE_COUNT   32767 /* most times generated code plays a phrase in one call */
+#define MAX_IC_INDEX     32767 /* largest int, and so table index, in Interactive C */
+#define CODE_BUFFER_SIZE 65536 /* bytes of generated code gathered before they are written */
+
+/**
+ * A tone, or a phrase played a number of times, in the code generated
+ * for a song.
+ */
+typedef struct tagCodeEvent
+{
+  long symbol;                 /* index of a tone, or -1 - index of a phrase */
+  unsigned long count;
+} CodeEvent;
+
+/**
+ * A hash table mapping keys to indices, used to find tones and loops
+ * that were already added to the code for a song.
+ */
+typedef struct tagCodeTable
+{
+  unsigned long long* keys;
+  unsigned long* values;       /* index + 1, or 0 for an empty slot */
+  unsigned long capacity;
+  unsigned long size;
+} CodeTable;
+
+/**
+ * The code for a song: a table of every distinct tone, and a list of
+ * words played by a small loop.  A word is the index of a tone, or
+ * -1 - the index of a phrase followed by the number of times to play
+ * it.  Phrases are ranges of the words; the song's own phrases keep
+ * their indices and are followed by loops found in the song.
+ */
+typedef struct tagSongCode
+{
+  Frequency* tones;
+  unsigned long num_tones;
+  unsigned long tone_capacity;
+  long* words;
+  unsigned long num_words;
+  unsigned long word_capacity;
+  unsigned long* phrase_first;
+  unsigned long* phrase_last;
+  unsigned long num_phrases;
+  unsigned long phrase_capacity;
+  unsigned long first;         /* range of the words played by the song itself */
+  unsigned long last;
+  CodeTable tone_table;
+  CodeTable loop_table;
+  CodeEvent* loop_events;      /* the events each loop was made from */
+  unsigned long num_loop_events;
+  unsigned long loop_event_capacity;
+  unsigned long* loop_offset;  /* per loop, where its events start in loop_events */
+  unsigned long* loop_length;
+  unsigned long num_loops;
+  unsigned long loop_capacity;
+} SongCode;
+
+/**
+ * The track of a MIDI file as it is being written.  Events are timed
+ * from the exact number of samples played before them, so the MIDI
+ * file keeps the same time as a rendered WAVE file.
+ */
+typedef struct tagMidiTrack
+{
+  unsigned char* data;
+  size_t length;
+  size_t capacity;
+  unsigned long long samples;       /* samples played so far */
+  unsigned long long tick;          /* time of the last event written */
+  unsigned long long tempo_samples; /* samples and ticks played before */
+  unsigned long long tempo_tick;    /* the current tempo was set */
+  unsigned long l4_per_minute;
+} MidiTrack;
+
+/**
+ * Generated code being written.  Lines are gathered in a large buffer
+ * and written out whole, rather than formatted through stdio a value
+ * at a time.
+ */
+typedef struct tagCodeBuffer
+{
+  FILE* file;
+  size_t length;
+  char data[CODE_BUFFER_SIZE];
+} CodeBuffer;
+
+/**
+ * The audible part of a WAVE file being found, so that only it is
+ * preallocated and the long silences in between are left as holes.
+ * Offsets are in bytes from the start of the file.
+ */
+typedef struct tagAudibleRun
+{
+  int fd;
+  int error;
+  unsigned long long start;         /* where the current audible run starts */
+  unsigned long long silence_start; /* where the silence that follows it starts */
+  unsigned long long position;      /* samples played so far */
+} AudibleRun;
+
+/**
+ * A single-producer, single-consumer ring of blocks through which a
+ * WAVE file is streamed: the renderer fills blocks while a writer
+ * thread writes them out.  head and tail only ever grow; each side
+ * moves its own without locking, and only takes the lock to sleep when
+ * the ring is full or empty.
+ *
+ * When the output is a pipe, the writer gifts the blocks' pages to the
+ * pipe with vmsplice() instead of copying them.  A reader may go on
+ * holding those pages well after the pipe is empty, for instance by
+ * splicing them onward, so a spliced block is never rendered over:
+ * fresh pages are mapped in its place before it is given back.
+ */
+typedef struct tagRing
+{
+  unsigned char* blocks;          /* depth page-aligned blocks of RING_BLOCK_SIZE bytes */
+  size_t* lengths;                /* bytes used in each block */
+  unsigned long depth;
+  atomic_ulong head;              /* blocks filled by the renderer */
+  atomic_ulong tail;              /* blocks the renderer may fill again */
+  atomic_int finished;            /* set once the last block is filled */
+  atomic_int renderer_waiting;
+  atomic_int writer_waiting;
+  atomic_int error;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int threaded;                   /* 0 if the renderer writes its own blocks */
+  int fd;
+  int sparse;                     /* whether long silences may be seeked over */
+  int splice;                     /* whether blocks are spliced into a pipe */
+  unsigned long long spliced;     /* bytes spliced so far */
+  unsigned long long hole;        /* zero bytes not yet written */
+  unsigned long long renderer_waits; /* times the ring was full */
+  unsigned long long writer_waits;   /* times the ring was empty */
+  double renderer_wait_seconds;
+  double writer_wait_seconds;
+  unsigned long peak;             /* most blocks ever filled but not yet written */
+} Ring;
+
+/**
+ * The renderer's side of a WAVE file being streamed through a Ring.
+ * Phrases are rendered once into buffers of their own, as long as
+ * they fit in what is left of WAVE_CACHE_SIZE, and copied from there;
+ * phrases that do not fit are synthesized again each time.
+ */
+typedef struct tagWaveStream
+{
+  Ring* ring;
+  unsigned char* block;           /* the block being filled */
+  size_t length;                  /* bytes of it filled so far */
+  Song* song;
+  unsigned char** rendered;       /* per phrase, its cached rendering, if any */
+  char* cached;                   /* per phrase, whether rendered owns a buffer */
+  char* silent;
+  size_t cache_left;
+} WaveStream;
+
+/**
+ * One of the files, or STDOUT, that a song is converted to.  Every
+ * output is written from the same parsed song.
+ */
+typedef struct tagOutput
+{
+  char* filename;              /* NULL for STDOUT */
+  int conversion_mode;
+  Song* song;
+  unsigned long long first;    /* the samples of the song to render, */
+  unsigned long long last;     /* if this is a WAVE file */
+  int result;
+} Output;
+
+/**
+ * The cost of converting a song, worked out from its frequencies
+ * alone before any output is written.  The counts saturate at
+ * ULLONG_MAX instead of wrapping around.
+ */
+typedef struct tagSongEstimate
 {
-  double hertz;
-  double duration;
-  struct tagFrequency* next;
-} Frequency;
+  unsigned long long notes;         /* notes played, counting repetitions */
+  unsigned long long samples;       /* samples played, counting repetitions */
+  unsigned long long synthesized;   /* samples synthesized; each phrase is rendered once */
+  unsigned long long* phrase_notes; /* notes played by one play of each phrase */
+} SongEstimate;
 
-inline void logMessage(char* format, ...)
+static inline void logMessage(char* format, ...)
 {
   va_list va_alist = {0};
 
@@ -122,12 +465,174 @@ inline void logMessage(char* format, ...)
   va_end( va_alist );
 }
 
+#define DIAGNOSTIC_ERROR   0
+#define DIAGNOSTIC_WARNING 1
+
+#define DEFAULT_MAX_DIAGNOSTICS 100
+
+/**
+ * A syntax error or warning about a PLAY statement.  Diagnostics are
+ * collected as they are found and reported together once the
+ * statement is converted.
+ */
+typedef struct tagDiagnostic
+{
+  short severity;
+  char* message;
+  char* source;                /* for a syntax error, the statement it is in */
+  unsigned int source_length;
+  unsigned int offset;         /* and where in the statement */
+} Diagnostic;
+
+typedef struct tagDiagnostics
+{
+  Diagnostic* items;
+  unsigned long num_items;
+  unsigned long capacity;
+  unsigned long num_suppressed; /* diagnostics past max_diagnostics, which are only counted */
+} Diagnostics;
+
+unsigned long max_diagnostics = DEFAULT_MAX_DIAGNOSTICS; /* 0 for no limit */
+short json_diagnostics = 0;
+
+unsigned long ring_depth = DEFAULT_RING_DEPTH;
+short ring_stats = 0;
+Diagnostics all_diagnostics = {0};
+
+/**
+ * Where the current thread collects its diagnostics.  Work done in
+ * parallel collects them separately, so that they can be reported in
+ * the same order as if it had been done serially.
+ */
+static __thread Diagnostics* diagnostics = &all_diagnostics;
+
+/**
+ * Internal function to add a diagnostic to the current thread's
+ * diagnostics.  Returns NULL if there are already max_diagnostics, in
+ * which case the diagnostic is only counted.
+ */
+static Diagnostic* addDiagnostic(short severity)
+{
+  Diagnostic* items;
+
+  if(max_diagnostics > 0 && diagnostics->num_items >= max_diagnostics) {
+    diagnostics->num_suppressed++;
+    return NULL;
+  }
+  if(diagnostics->num_items == diagnostics->capacity) {
+    diagnostics->capacity = (diagnostics->capacity < 16) ? 16 : 2 * diagnostics->capacity;
+    items = (Diagnostic*)realloc(diagnostics->items, sizeof(Diagnostic) * diagnostics->capacity);
+    if(items == NULL) {
+      logMessage("ERROR: Could not allocate enough memory!\n");
+      exit(-3);
+    }
+    diagnostics->items = items;
+  }
+  memset(&diagnostics->items[diagnostics->num_items], 0, sizeof(Diagnostic));
+  diagnostics->items[diagnostics->num_items].severity = severity;
+  return &diagnostics->items[diagnostics->num_items++];
+}
+
+/**
+ * Adds a warning, formatted as by printf, to the current thread's
+ * diagnostics.
+ */
+void warning(char* format, ...)
+{
+  va_list va_alist = {0};
+  Diagnostic* diagnostic = addDiagnostic(DIAGNOSTIC_WARNING);
+  int needed;
+
+  if(diagnostic == NULL)
+    return;
+  va_start(va_alist, format);
+  needed = vsnprintf(NULL, 0, format, va_alist);
+  va_end( va_alist );
+  diagnostic->message = (char*)malloc((needed < 0) ? 1 : needed + 1);
+  if(diagnostic->message == NULL) {
+    logMessage("ERROR: Could not allocate enough memory!\n");
+    exit(-3);
+  }
+  diagnostic->message[0] = '\0';
+  va_start(va_alist, format);
+  vsnprintf(diagnostic->message, needed + 1, format, va_alist);
+  va_end( va_alist );
+}
+
+void freeDiagnostics(Diagnostics* list)
+{
+  unsigned long i;
+
+  for(i=0; i<list->num_items; i++)
+    free(list->items[i].message);
+  free(list->items);
+  memset(list, 0, sizeof(Diagnostics));
+}
+
+/**
+ * Moves every diagnostic in from to the end of to, keeping at most
+ * max_diagnostics.
+ */
+void appendDiagnostics(Diagnostics* to, Diagnostics* from)
+{
+  Diagnostics* previous = diagnostics;
+  Diagnostic* diagnostic;
+  unsigned long i;
+
+  diagnostics = to;
+  for(i=0; i<from->num_items; i++) {
+    diagnostic = addDiagnostic(from->items[i].severity);
+    if(diagnostic == NULL)
+      continue;
+    *diagnostic = from->items[i];
+    from->items[i].message = NULL;
+  }
+  to->num_suppressed += from->num_suppressed;
+  diagnostics = previous;
+  freeDiagnostics(from);
+}
+
+/**
+ * Internal function to store a little-endian 32-bit value.
+ */
+static void putLE32(unsigned char* bytes, unsigned long value)
+{
+  bytes[0] = (value & 0x000000ff);
+  bytes[1] = (value & 0x0000ff00) >> 8;
+  bytes[2] = (value & 0x00ff0000) >> 16;
+  bytes[3] = (value & 0xff000000) >> 24;
+}
+
+/**
+ * Internal function to store a little-endian 64-bit value.
+ */
+static void putLE64(unsigned char* bytes, unsigned long long value)
+{
+  putLE32(bytes, (unsigned long)(value & 0xffffffffULL));
+  putLE32(bytes + 4, (unsigned long)(value >> 32));
+}
+
+/**
+ * Returns the bytes of header preceding nsamples samples in a WAVE
+ * file.  A RIFF file can be at most 4 GB long, so longer ones are
+ * written as RF64 files instead, which keep their sizes in a ds64
+ * chunk.
+ */
+size_t waveHeaderSize(unsigned long long nsamples)
+{
+  return (2 * nsamples + WAVE_HEADER_SIZE - 8 > 0xffffffffULL) ? RF64_HEADER_SIZE : WAVE_HEADER_SIZE;
+}
+
 /**
- * Writes the specified samples to a WAVE sound file.  The WAVE file
- * is set up with one 16-bit channel.  Endian independent.
+ * Writes the header of a WAVE sound file to the waveHeaderSize()
+ * bytes at header.  The WAVE file is set up with one 16-bit channel.
+ * The nsamples samples themselves are expected to follow immediately
+ * after the header.  If they do not fit in a RIFF file, the header is
+ * that of an RF64 file (EBU Tech 3306), whose 32-bit sizes are all
+ * 0xffffffff and whose ds64 chunk holds the real, 64-bit ones.
+ * Endian independent.
  *
- * fptr     - pointer to the file to which to write
- * samples  - array of sample values
+ * header   - buffer of at least waveHeaderSize(nsamples) bytes
  * nsamples - number of samples
  * nfreq    - sample frequency
  *
@@ -141,76 +646,42 @@ inline void logMessage(char* format, ...)
  *
  * http://astronomy.swin.edu.au/~pbourke/
  */
-void writeWave(FILE *fptr, double *samples, long nsamples, int nfreq)
+void writeWaveHeader(unsigned char* header, unsigned long long nsamples, int nfreq)
 {
-   unsigned short v;
-   int i;
-   unsigned long totalsize, bytespersec;
-   double themin, themax, scale, themid;
+   size_t size = waveHeaderSize(nsamples);
 
    /* Write the form chunk */
-   fprintf(fptr, "RIFF");
-   totalsize = 2 * nsamples + 36;
-   fputc((totalsize & 0x000000ff), fptr);       /* File size */
-   fputc((totalsize & 0x0000ff00) >> 8, fptr);
-   fputc((totalsize & 0x00ff0000) >> 16, fptr);
-   fputc((totalsize & 0xff000000) >> 24, fptr);
-   fprintf(fptr, "WAVE");
-   fprintf(fptr, "fmt ");                       /* fmt_ chunk */
-   fputc(16, fptr);                             /* Chunk size */
-   fputc(0, fptr);
-   fputc(0, fptr);
-   fputc(0, fptr);
-   fputc(1, fptr);                              /* Format tag - uncompressed */
-   fputc(0, fptr);
-   fputc(1, fptr);                              /* Channels */
-   fputc(0, fptr);
-   fputc((nfreq & 0x000000ff), fptr);           /* Sample frequency (Hz) */
-   fputc((nfreq & 0x0000ff00) >> 8, fptr);
-   fputc((nfreq & 0x00ff0000) >> 16, fptr);
-   fputc((nfreq & 0xff000000) >> 24, fptr);
-   bytespersec = 2 * nfreq;
-   fputc((bytespersec & 0x000000ff), fptr);     /* Average bytes per second */
-   fputc((bytespersec & 0x0000ff00) >> 8, fptr);
-   fputc((bytespersec & 0x00ff0000) >> 16, fptr);
-   fputc((bytespersec & 0xff000000) >> 24, fptr);
-   fputc(2, fptr);                              /* Block alignment */
-   fputc(0, fptr);
-   fputc(16, fptr);                             /* Bits per sample */
-   fputc(0,fptr);
-   fprintf(fptr, "data");
-   totalsize = 2 * nsamples;
-   fputc((totalsize & 0x000000ff), fptr);       /* Data size */
-   fputc((totalsize & 0x0000ff00) >> 8, fptr);
-   fputc((totalsize & 0x00ff0000) >> 16, fptr);
-   fputc((totalsize & 0xff000000) >> 24, fptr);
-
-   /* Find the range */
-   themin = samples[0];
-   themax = themin;
-   for (i=1;i<nsamples;i++) {
-      if (samples[i] > themax)
-         themax = samples[i];
-      if (samples[i] < themin)
-         themin = samples[i];
+   if(size == RF64_HEADER_SIZE) {
+     memcpy(header, "RF64", 4);
+     putLE32(header + 4, 0xffffffffUL);         /* File size, given by ds64 */
+     memcpy(header + 8, "WAVE", 4);
+     memcpy(header + 12, "ds64", 4);            /* ds64 chunk */
+     putLE32(header + 16, 28);                  /* Chunk size */
+     putLE64(header + 20, 2 * nsamples + size - 8); /* File size */
+     putLE64(header + 28, 2 * nsamples);        /* Data size */
+     putLE64(header + 36, nsamples);            /* Sample count */
+     putLE32(header + 44, 0);                   /* Table length */
+     header += 36;
    }
-   if (themin >= themax) {
-      themin -= 1;
-      themax += 1;
-   }
-   themid = (themin + themax) / 2;
-   themin -= themid;
-   themax -= themid;
-   if (ABS(themin) > ABS(themax))
-      themax = ABS(themin);
-   scale = 32760 / (themax);
-
-   /* Write the data */
-   for (i=0;i<nsamples;i++) {
-      v = (unsigned short)(scale * (samples[i] - themid));
-      fputc((v & 0x00ff),fptr);
-      fputc((v & 0xff00) >> 8,fptr);
+   else {
+     memcpy(header, "RIFF", 4);
+     putLE32(header + 4, 2 * nsamples + 36);    /* File size */
+     memcpy(header + 8, "WAVE", 4);
    }
+   memcpy(header + 12, "fmt ", 4);              /* fmt_ chunk */
+   putLE32(header + 16, 16);                    /* Chunk size */
+   header[20] = 1;                              /* Format tag - uncompressed */
+   header[21] = 0;
+   header[22] = 1;                              /* Channels */
+   header[23] = 0;
+   putLE32(header + 24, nfreq);                 /* Sample frequency (Hz) */
+   putLE32(header + 28, 2 * nfreq);             /* Average bytes per second */
+   header[32] = 2;                              /* Block alignment */
+   header[33] = 0;
+   header[34] = 16;                             /* Bits per sample */
+   header[35] = 0;
+   memcpy(header + 36, "data", 4);
+   putLE32(header + 40, (size == RF64_HEADER_SIZE) ? 0xffffffffUL : 2 * nsamples); /* Data size */
 }
 
 /**
@@ -218,219 +689,576 @@ void writeWave(FILE *fptr, double *samples, long nsamples, int nfreq)
  */
 void freeNotes(Note* starting_note)
 {
-  if(starting_note == NULL)
-    return;
-  if(starting_note->next != NULL)
-    freeNotes(starting_note->next);
-  free(starting_note);
+  Note* next;
+  while(starting_note != NULL) {
+    next = starting_note->next;
+    free(starting_note);
+    starting_note = next;
+  }
 }
 
 /**
- * Deletes a frequency linked list
+ * Deletes the frequencies of a song
  */
-void freeFrequencies(Frequency* starting_frequency)
+void freeSong(Song* song)
 {
-  if(starting_frequency == NULL)
-    return;
-  if(starting_frequency->next != NULL)
-    freeFrequencies(starting_frequency->next);
-  free(starting_frequency);
+  unsigned long i;
+
+  for(i=0; i<song->num_phrases; i++)
+    freeSong(&song->phrases[i]);
+  free(song->phrases);
+  if(song->capacity > 0)
+    free(song->frequencies);
+  if(song->mapping != NULL)
+    munmap(song->mapping, song->mapping_size);
+  free(song->timeline);
+  free(song->phrase_slots);
+  memset(song, 0, sizeof(Song));
+}
+
+static unsigned long long saturatingAdd(unsigned long long a, unsigned long long b)
+{
+  return (a + b < a) ? ULLONG_MAX : a + b;
+}
+
+static unsigned long long saturatingMultiply(unsigned long long a, unsigned long long b)
+{
+  unsigned long long product;
+
+  return __builtin_mul_overflow(a, b, &product) ? ULLONG_MAX : product;
 }
 
 /**
- * Internal function used to add a new frequency to a frequency linked
- * list
+ * Internal function used to add a new (packed) frequency to the end
+ * of a song, without counting its samples.
  */
-void addFrequency(double hertz, double duration, Frequency** current_frequency, Frequency** last_frequency) {
-  if(*current_frequency == NULL) {
-    *current_frequency = (Frequency*)malloc(sizeof(Frequency));
+static void appendFrequency(Frequency frequency, Song* song) {
+  Frequency* frequencies;
+
+  if(song->num_frequencies == song->capacity) {
+    song->capacity = (song->capacity < 64) ? 64 : 2 * song->capacity;
+    frequencies = (Frequency*)realloc(song->frequencies, sizeof(Frequency) * song->capacity);
+    if(frequencies == NULL) {
+      logMessage("ERROR: Could not allocate enough memory!\n");
+      exit(-3);
+    }
+    song->frequencies = frequencies;
   }
-  
-  (*current_frequency)->hertz = hertz;
-  (*current_frequency)->duration = duration;
-  (*current_frequency)->next = NULL;
-  if(*last_frequency != NULL)
-    (*last_frequency)->next = *current_frequency;
-  
-  *last_frequency = *current_frequency;
-  *current_frequency = NULL;
+
+  song->frequencies[song->num_frequencies++] = frequency;
 }
 
 /**
- * Converts a linked list of notes to a linked list of frequencies.
- *
- * starting_note - pointer to the first note in the notes lined list
- * head          - pointer to what is to be the head of the new frequencies
- *                 linked list.  Note that the value of the head will be set;
- *                 any value it currently has will be overwritten.
+ * Internal function used to add a new frequency to the end of a song
  */
-double notesToFrequency(Note* starting_note, Frequency* head)
-{
-  short octave = 0;
-  double duration = 4;
-  double tmp_duration, adjusted_duration;
-  double l4_per_minute = 120;
-  int music_code = CODE_MUSIC_NORMAL;
-  Note* current_note = starting_note;
-  double total_duration = 0;
-  Frequency* last_frequency = NULL;
-  Frequency* current_frequency = head;
-  double hertz = 0;
+void addFrequency(unsigned int pitch, unsigned long long samples, Song* song) {
+  appendFrequency(FREQUENCY(pitch, samples), song);
+  song->total_samples += samples;
+}
+
+/**
+ * Internal function used to mark a change of tempo at the end of a song
+ */
+void addTempo(unsigned long l4_per_minute, Song* song) {
+  appendFrequency(TEMPO_CHANGE(l4_per_minute), song);
+}
+
+/**
+ * Internal function used to add a reference to count plays of one of
+ * root's phrases to the end of a song.  Returns -1, adding nothing, if
+ * the song would then play for longer than MAX_SONG_SAMPLES.
+ */
+int addPhrase(unsigned long index, unsigned long count, Song* song, Song* root) {
+  unsigned long long samples = saturatingMultiply(count, root->phrases[index].total_samples);
 
-  if(starting_note == NULL || head == NULL)
+  if(samples > MAX_SONG_SAMPLES || song->total_samples + samples > MAX_SONG_SAMPLES)
+    return -1;
+  if(root->phrases[index].num_frequencies == 0)
     return 0;
+  appendFrequency(PHRASE_REFERENCE(index, count), song);
+  song->total_samples += samples;
+  return 0;
+}
 
-  while(current_note != NULL) {
-    if(current_note->code & CODE_NOTE) {
-      if(current_note->value & NOTE_A) {
-	if(current_note->value & NOTE_SHARP) {
-	  hertz = ASHARP(octave);
-	}
-	else if(current_note->value & NOTE_FLAT) {
-	  hertz = AFLAT(octave);
-	}
-	else
-	  hertz = A(octave);
-      }
-      if(current_note->value & NOTE_B) {
-	if(current_note->value & NOTE_SHARP) {
-	  hertz = BSHARP(octave);
-	}
-	else if(current_note->value & NOTE_FLAT) {
-	  hertz = BFLAT(octave);
-	}
-	else
-	  hertz = B(octave);
-      }
-      if(current_note->value & NOTE_C) {
-	if(current_note->value & NOTE_SHARP) {
-	  hertz = CSHARP(octave);
-	}
-	else if(current_note->value & NOTE_FLAT) {
-	  hertz = CFLAT(octave);
-	}
-	else
-	  hertz = C(octave);
-      }
-      if(current_note->value & NOTE_D) {
-	if(current_note->value & NOTE_SHARP) {
-	  hertz = DSHARP(octave);
-	}
-	else if(current_note->value & NOTE_FLAT) {
-	  hertz = DFLAT(octave);
-	}
-	else
-	  hertz = D(octave);
-      }
-      if(current_note->value & NOTE_E) {
-	if(current_note->value & NOTE_SHARP) {
-	  hertz = ESHARP(octave);
-	}
-	else if(current_note->value & NOTE_FLAT) {
-	  hertz = EFLAT(octave);
-	}
-	else
-	  hertz = E(octave);
-      }
-      if(current_note->value & NOTE_F) {
-	if(current_note->value & NOTE_SHARP) {
-	  hertz = FSHARP(octave);
-	}
-	else if(current_note->value & NOTE_FLAT) {
-	  hertz = FFLAT(octave);
-	}
-	else
-	  hertz = F(octave);
-      }
-      if(current_note->value & NOTE_G) {
-	if(current_note->value & NOTE_SHARP) {
-	  hertz = GSHARP(octave);
-	}
-	else if(current_note->value & NOTE_FLAT) {
-	  hertz = GFLAT(octave);
-	}
-	else
-	  hertz = G(octave);
-      }
+/**
+ * Returns the number of samples in numerator / denominator seconds,
+ * rounded down.  All note lengths are rational numbers of seconds, so
+ * computing them this way keeps every sample count exact; nothing is
+ * lost to floating point no matter how long the song is.
+ */
+static unsigned long long samplesIn(unsigned long long numerator, unsigned long long denominator)
+{
+  return (numerator * SAMPLE_RATE) / denominator;
+}
 
-      tmp_duration = 1.0 / duration * 60.0 / l4_per_minute;
-      if(current_note->code & CODE_DOTTED_NOTE) {
-	tmp_duration = tmp_duration * 3.0 / 2.0;
-      }
-      adjusted_duration = tmp_duration;
-      if(music_code == CODE_MUSIC_NORMAL) {
-	adjusted_duration = tmp_duration * 7.0 / 8.0;
-      }
-      else if(music_code == CODE_MUSIC_STACCATO) {
-	adjusted_duration = tmp_duration * 3.0 / 4.0;
-      }
-      addFrequency(hertz, adjusted_duration, &current_frequency, &last_frequency);
-      total_duration += adjusted_duration;
-      if(music_code == CODE_MUSIC_NORMAL) {
-	addFrequency(0, tmp_duration / 8.0, &current_frequency, &last_frequency);
-	total_duration += tmp_duration / 8.0;
-      }
-      else if(music_code == CODE_MUSIC_STACCATO) {
-	addFrequency(0, tmp_duration / 4.0, &current_frequency, &last_frequency);
-	total_duration += tmp_duration / 4.0;
-      }
+/**
+ * Fills in pitch_hertz.
+ */
+void initPitches()
+{
+  short octave;
+
+  pitch_hertz[PITCH_SILENCE] = 0;
+  for(octave=0; octave<=6; octave++) {
+    pitch_hertz[PITCH(octave, SEMITONE_C)] = C(octave);
+    pitch_hertz[PITCH(octave, SEMITONE_CSHARP)] = CSHARP(octave);
+    pitch_hertz[PITCH(octave, SEMITONE_D)] = D(octave);
+    pitch_hertz[PITCH(octave, SEMITONE_EFLAT)] = EFLAT(octave);
+    pitch_hertz[PITCH(octave, SEMITONE_E)] = E(octave);
+    pitch_hertz[PITCH(octave, SEMITONE_F)] = F(octave);
+    pitch_hertz[PITCH(octave, SEMITONE_FSHARP)] = FSHARP(octave);
+    pitch_hertz[PITCH(octave, SEMITONE_G)] = G(octave);
+    pitch_hertz[PITCH(octave, SEMITONE_AFLAT)] = AFLAT(octave);
+    pitch_hertz[PITCH(octave, SEMITONE_A)] = A(octave);
+    pitch_hertz[PITCH(octave, SEMITONE_BFLAT)] = BFLAT(octave);
+    pitch_hertz[PITCH(octave, SEMITONE_B)] = B(octave);
+  }
+}
+
+/**
+ * Returns the pitch of a note (as produced by parsePlayStatement())
+ * in the given octave, which must be in the range 0--6.  If the note
+ * does not name a pitch, the pitch of the previous note is kept.
+ */
+unsigned int notePitch(int value, short octave, unsigned int previous_pitch)
+{
+  unsigned int pitch = previous_pitch;
+
+  if(value & NOTE_A) {
+    if(value & NOTE_SHARP) {
+      pitch = PITCH(octave, SEMITONE_BFLAT);
     }
-    else if(current_note->code & CODE_L4_PER_MINUTE) {
-      l4_per_minute = current_note->value;
-      if(l4_per_minute < 32) {
-	logMessage("WARNING: Quarter notes per minute set to %.4f; minimum is 32!\n", l4_per_minute);
-	l4_per_minute = 32;
-      }
-      else if(l4_per_minute > 255) {
-	logMessage("WARNING: Quarter notes per minute set to %.4f; maximum is 255!\n", l4_per_minute);
-	l4_per_minute = 255;
-      }
+    else if(value & NOTE_FLAT) {
+      pitch = PITCH(octave, SEMITONE_AFLAT);
     }
-    else if(current_note->code & CODE_DURATION) {
-      duration = current_note->value;
+    else
+      pitch = PITCH(octave, SEMITONE_A);
+  }
+  if(value & NOTE_B) {
+    if(value & NOTE_SHARP) {
+      pitch = PITCH(octave, SEMITONE_C);
     }
-    else if(current_note->code & CODE_OCTAVE) {
-      octave = current_note->value;
-      if(octave < 0) {
-	logMessage("WARNING: Octave set at %d; minimum is 0!\n", octave);
-	octave = 0;
-      }
-      else if(octave > 6) {
-	logMessage("WARNING: Octave set at %d; maximum is 6!\n", octave);
-	octave = 6;
-      }
+    else if(value & NOTE_FLAT) {
+      pitch = PITCH(octave, SEMITONE_BFLAT);
     }
-    else if(current_note->code & CODE_PAUSE) {
-      tmp_duration = 1.0 / current_note->value * l4_per_minute / 60.0;
-      if(current_note->code & CODE_DOTTED_NOTE) {
-	tmp_duration = tmp_duration * 3.0 / 2.0;
-      }
-      total_duration += tmp_duration;
-      addFrequency(0, tmp_duration, &current_frequency, &last_frequency);
+    else
+      pitch = PITCH(octave, SEMITONE_B);
+  }
+  if(value & NOTE_C) {
+    if(value & NOTE_SHARP) {
+      pitch = PITCH(octave, SEMITONE_CSHARP);
     }
-    else if(current_note->code & CODE_MUSIC) {
-      music_code = current_note->code;
+    else if(value & NOTE_FLAT) {
+      pitch = PITCH(octave, SEMITONE_B);
     }
-    current_note = current_note->next;
+    else
+      pitch = PITCH(octave, SEMITONE_C);
   }
-
-  return total_duration;
+  if(value & NOTE_D) {
+    if(value & NOTE_SHARP) {
+      pitch = PITCH(octave, SEMITONE_EFLAT);
+    }
+    else if(value & NOTE_FLAT) {
+      pitch = PITCH(octave, SEMITONE_CSHARP);
+    }
+    else
+      pitch = PITCH(octave, SEMITONE_D);
+  }
+  if(value & NOTE_E) {
+    if(value & NOTE_SHARP) {
+      pitch = PITCH(octave, SEMITONE_F);
+    }
+    else if(value & NOTE_FLAT) {
+      pitch = PITCH(octave, SEMITONE_EFLAT);
+    }
+    else
+      pitch = PITCH(octave, SEMITONE_E);
+  }
+  if(value & NOTE_F) {
+    if(value & NOTE_SHARP) {
+      pitch = PITCH(octave, SEMITONE_FSHARP);
+    }
+    else if(value & NOTE_FLAT) {
+      pitch = PITCH(octave, SEMITONE_E);
+    }
+    else
+      pitch = PITCH(octave, SEMITONE_F);
+  }
+  if(value & NOTE_G) {
+    if(value & NOTE_SHARP) {
+      pitch = PITCH(octave, SEMITONE_AFLAT);
+    }
+    else if(value & NOTE_FLAT) {
+      pitch = PITCH(octave, SEMITONE_FSHARP);
+    }
+    else
+      pitch = PITCH(octave, SEMITONE_G);
+  }
+  return pitch;
 }
 
 /**
- * Prints a syntax error message
+ * Applies a note that does not make a sound (a change of octave,
+ * length, tempo or music mode) to a music state.  Out of range values
+ * are clamped, with a warning only if verbose is set.
  */
-void syntaxError(char* comment, char* play, unsigned int play_length, unsigned int offset)
+void updateMusicState(MusicState* state, Note* note, short verbose)
 {
-  char buffer[81];
-  short leftover = 0;
-  short rightover = 0;
-  unsigned int i;
-  if(play_length > 80) {
-    if(offset < 40) {
-      rightover = 1;
+  if(note->code & CODE_L4_PER_MINUTE) {
+    if(note->value < 32) {
+      if(verbose)
+	warning("Quarter notes per minute set to %d; minimum is 32!", note->value);
+      state->l4_per_minute = 32;
     }
-    else if(offset > play_length - 40) {
+    else if(note->value > 255) {
+      if(verbose)
+	warning("Quarter notes per minute set to %d; maximum is 255!", note->value);
+      state->l4_per_minute = 255;
+    }
+    else
+      state->l4_per_minute = note->value;
+  }
+  else if(note->code & CODE_DURATION) {
+    state->last_duration = note->value;
+    if(note->value < 1) {
+      if(verbose)
+	warning("Note length set to %d; minimum is 1!", note->value);
+      state->duration = 1;
+    }
+    else
+      state->duration = note->value;
+  }
+  else if(note->code & CODE_OCTAVE) {
+    state->last_octave = note->value;
+    state->octave = note->value;
+    if(state->octave < 0) {
+      if(verbose)
+	warning("Octave set at %d; minimum is 0!", state->octave);
+      state->octave = 0;
+    }
+    else if(state->octave > 6) {
+      if(verbose)
+	warning("Octave set at %d; maximum is 6!", state->octave);
+      state->octave = 6;
+    }
+  }
+  else if(note->code & CODE_MUSIC) {
+    state->music_code = note->code;
+  }
+}
+
+/**
+ * Sets a music state to the state at the start of every PLAY
+ * statement.
+ */
+void initMusicState(MusicState* state)
+{
+  state->octave = 0;
+  state->duration = 4;
+  state->l4_per_minute = 120;
+  state->music_code = CODE_MUSIC_NORMAL;
+  state->pitch = PITCH_SILENCE;
+  state->last_octave = 0;
+  state->last_duration = 4;
+}
+
+/**
+ * Returns non-zero if two music states are the same.
+ */
+int sameMusicState(MusicState* a, MusicState* b)
+{
+  return a->octave == b->octave && a->duration == b->duration &&
+    a->l4_per_minute == b->l4_per_minute && a->music_code == b->music_code &&
+    a->pitch == b->pitch && a->last_octave == b->last_octave &&
+    a->last_duration == b->last_duration;
+}
+
+unsigned long long convertNotes(Note* starting_note, Note* stop_note, MusicState* state, Song* song, Song* root);
+
+/**
+ * Internal function to hash a sub-string together with the music
+ * state it is played from.
+ */
+static unsigned long long hashPhrase(int substring, MusicState* state)
+{
+  unsigned long long fields[8];
+  unsigned long long hash = 14695981039346656037ULL;
+  unsigned int i;
+
+  fields[0] = (unsigned long long)substring;
+  fields[1] = (unsigned long long)state->octave;
+  fields[2] = state->duration;
+  fields[3] = state->l4_per_minute;
+  fields[4] = (unsigned long long)state->music_code;
+  fields[5] = state->pitch;
+  fields[6] = (unsigned long long)state->last_octave;
+  fields[7] = (unsigned long long)state->last_duration;
+  for(i=0; i<8; i++)
+    hash = (hash ^ fields[i]) * 1099511628211ULL;
+  return hash;
+}
+
+/**
+ * Internal function to add the next phrase of root to its hash table,
+ * doubling the table whenever it gets half full.
+ */
+static void indexPhrase(Song* root)
+{
+  unsigned long slot, i, count = root->num_indexed_phrases;
+  Song* phrase = &root->phrases[count];
+
+  if(2 * (count + 1) > root->phrase_slot_capacity) {
+    free(root->phrase_slots);
+    root->phrase_slot_capacity = (root->phrase_slot_capacity < 64) ? 64 : 2 * root->phrase_slot_capacity;
+    root->phrase_slots = (unsigned long*)calloc(root->phrase_slot_capacity, sizeof(unsigned long));
+    if(root->phrase_slots == NULL) {
+      logMessage("ERROR: Could not allocate enough memory!\n");
+      exit(-3);
+    }
+    root->num_indexed_phrases = 0;
+    for(i=0; i<count; i++)
+      indexPhrase(root);
+  }
+  for(slot = hashPhrase(phrase->substring, &phrase->start) & (root->phrase_slot_capacity - 1);
+      root->phrase_slots[slot] != 0; slot = (slot + 1) & (root->phrase_slot_capacity - 1));
+  root->phrase_slots[slot] = count + 1;
+  root->num_indexed_phrases++;
+}
+
+/**
+ * Returns the index of the phrase of root that a sub-string played
+ * from a music state was converted to, or root->num_phrases if it has
+ * not been converted yet.  Phrases added to root since the last call
+ * are indexed first.
+ */
+static unsigned long findPhrase(Song* root, unsigned int substring, MusicState* state)
+{
+  unsigned long slot, index;
+
+  while(root->num_indexed_phrases < root->num_phrases)
+    indexPhrase(root);
+  if(root->phrase_slot_capacity == 0)
+    return root->num_phrases;
+  for(slot = hashPhrase((int)substring, state) & (root->phrase_slot_capacity - 1);
+      root->phrase_slots[slot] != 0; slot = (slot + 1) & (root->phrase_slot_capacity - 1)) {
+    index = root->phrase_slots[slot] - 1;
+    if(root->phrases[index].substring == (int)substring && sameMusicState(&root->phrases[index].start, state))
+      return index;
+  }
+  return root->num_phrases;
+}
+
+/**
+ * Plays a sub-string count times, appending references to its phrases
+ * to a song.  The frequencies of a sub-string played from a given
+ * music state are only ever converted once; they are stored as a
+ * phrase in root and reused every time the sub-string is played from
+ * that state again, found through a hash table of root's phrases.
+ * Returns the number of samples added to the song.
+ */
+unsigned long long executeSubstring(unsigned int substring, unsigned long count, MusicState* state, Song* song, Song* root)
+{
+  unsigned long index, plays;
+  unsigned long long total_samples = 0;
+  Song* phrases;
+  Song phrase;
+
+  while(count > 0) {
+    index = findPhrase(root, substring, state);
+    if(index == root->num_phrases) {
+      if(substrings[substring].status == SUBSTRING_PARSING || root->num_phrases >= MAX_PHRASES) {
+	warning("Sub-string %s cannot be played here!", substrings[substring].name);
+	return total_samples;
+      }
+      memset(&phrase, 0, sizeof(Song));
+      phrase.substring = substring;
+      phrase.start = *state;
+      phrase.end = *state;
+      substrings[substring].status = SUBSTRING_PARSING;
+      convertNotes(substrings[substring].notes, NULL, &phrase.end, &phrase, root);
+      substrings[substring].status = SUBSTRING_PARSED;
+
+      if(root->num_phrases == root->phrase_capacity) {
+	root->phrase_capacity = (root->phrase_capacity < 16) ? 16 : 2 * root->phrase_capacity;
+	phrases = (Song*)realloc(root->phrases, sizeof(Song) * root->phrase_capacity);
+	if(phrases == NULL) {
+	  logMessage("ERROR: Could not allocate enough memory!\n");
+	  exit(-3);
+	}
+	root->phrases = phrases;
+      }
+      index = root->num_phrases++;
+      root->phrases[index] = phrase;
+    }
+
+    /**
+     * If playing the phrase leaves the music state unchanged, every
+     * remaining play is identical.
+     */
+    plays = sameMusicState(&root->phrases[index].start, &root->phrases[index].end) ? count : 1;
+    if(addPhrase(index, plays, song, root) != 0) {
+      warning("Playing sub-string %s %lu times makes the song too long; it is left out!", substrings[substring].name, plays);
+      return total_samples;
+    }
+    total_samples += plays * root->phrases[index].total_samples;
+    *state = root->phrases[index].end;
+    count -= plays;
+  }
+
+  return total_samples;
+}
+
+/**
+ * Converts the notes from starting_note up to (but not including)
+ * stop_note to frequencies, appending them to a song.  state holds
+ * the music state in effect before starting_note and is updated as
+ * the notes are played.  Phrases played with X are added to root,
+ * which is normally the song itself.  Returns the number of samples
+ * spanned by the new frequencies.
+ */
+unsigned long long convertNotes(Note* starting_note, Note* stop_note, MusicState* state, Song* song, Song* root)
+{
+  unsigned long long length_samples, sound_samples;
+  unsigned int dot_numerator, dot_denominator;
+  unsigned long repeat = 1;
+  unsigned long l4_per_minute;
+  Note* current_note = starting_note;
+  Note resolved_note;
+  unsigned long long total_samples = 0;
+
+  while(current_note != stop_note) {
+    if(current_note->code & CODE_RELATIVE) {
+      /**
+       * Only sub-strings still have relative notes at this point; they
+       * are relative to the state the phrase being converted started in.
+       */
+      resolved_note = *current_note;
+      resolved_note.code &= ~CODE_RELATIVE;
+      if(resolved_note.code & CODE_OCTAVE)
+	resolved_note.value = (short)(song->start.last_octave + resolved_note.value);
+      else
+	resolved_note.value = song->start.last_duration;
+      updateMusicState(state, &resolved_note, 1);
+    }
+    else if(current_note->code & CODE_REPEAT) {
+      repeat = current_note->value;
+    }
+    else if(current_note->code & CODE_EXECUTE) {
+      total_samples += executeSubstring(current_note->value, repeat, state, song, root);
+      repeat = 1;
+    }
+    else if(current_note->code & CODE_NOTE) {
+      state->pitch = notePitch(current_note->value, state->octave, state->pitch);
+
+      dot_numerator = 1;
+      dot_denominator = 1;
+      if(current_note->code & CODE_DOTTED_NOTE) {
+	dot_numerator = 3;
+	dot_denominator = 2;
+      }
+      /* length is 60 / (duration * l4_per_minute) seconds */
+      length_samples = samplesIn(60ULL * dot_numerator, (unsigned long long)state->duration * state->l4_per_minute * dot_denominator);
+      sound_samples = length_samples;
+      if(state->music_code == CODE_MUSIC_NORMAL) {
+	sound_samples = samplesIn(60ULL * dot_numerator * 7, (unsigned long long)state->duration * state->l4_per_minute * dot_denominator * 8);
+      }
+      else if(state->music_code == CODE_MUSIC_STACCATO) {
+	sound_samples = samplesIn(60ULL * dot_numerator * 3, (unsigned long long)state->duration * state->l4_per_minute * dot_denominator * 4);
+      }
+      addFrequency(state->pitch, sound_samples, song);
+      if(sound_samples < length_samples) {
+	addFrequency(PITCH_SILENCE, length_samples - sound_samples, song);
+      }
+      total_samples += length_samples;
+    }
+    else if(current_note->code & CODE_PAUSE) {
+      dot_numerator = 1;
+      dot_denominator = 1;
+      if(current_note->code & CODE_DOTTED_NOTE) {
+	dot_numerator = 3;
+	dot_denominator = 2;
+      }
+      /* a pause lasts l4_per_minute / (60 * value) seconds */
+      length_samples = 0;
+      if(current_note->value > 0)
+	length_samples = samplesIn((unsigned long long)state->l4_per_minute * dot_numerator, 60ULL * current_note->value * dot_denominator);
+      total_samples += length_samples;
+      addFrequency(PITCH_SILENCE, length_samples, song);
+    }
+    else {
+      l4_per_minute = state->l4_per_minute;
+      updateMusicState(state, current_note, 1);
+      if(state->l4_per_minute != l4_per_minute)
+	addTempo(state->l4_per_minute, song);
+    }
+    current_note = current_note->next;
+  }
+
+  return total_samples;
+}
+
+/**
+ * Converts a linked list of notes to the frequencies of a song.
+ * Returns the total number of samples spanned by the frequencies,
+ * which is exactly the sum of their sample counts.
+ *
+ * starting_note - pointer to the first note in the notes lined list
+ * song          - pointer to the song to fill in.  Note that any
+ *                 frequencies it currently has will be overwritten.
+ */
+unsigned long long notesToFrequency(Note* starting_note, Song* song)
+{
+  MusicState state;
+
+  song->num_frequencies = 0;
+  song->total_samples = 0;
+
+  if(starting_note == NULL)
+    return 0;
+
+  initMusicState(&state);
+
+  return convertNotes(starting_note, NULL, &state, song, song);
+}
+
+/**
+ * Adds a syntax error at offset in a PLAY statement to the current
+ * thread's diagnostics.
+ */
+void syntaxError(char* comment, char* play, unsigned int play_length, unsigned int offset)
+{
+  Diagnostic* diagnostic = addDiagnostic(DIAGNOSTIC_ERROR);
+
+  if(diagnostic == NULL)
+    return;
+  diagnostic->message = strdup(comment);
+  if(diagnostic->message == NULL) {
+    logMessage("ERROR: Could not allocate enough memory!\n");
+    exit(-3);
+  }
+  diagnostic->source = play;
+  diagnostic->source_length = play_length;
+  diagnostic->offset = offset;
+}
+
+/**
+ * Internal function to print a syntax error with the 80 characters
+ * of the statement around it, and a caret under the error.
+ */
+static void printSyntaxError(Diagnostic* diagnostic)
+{
+  char buffer[81];
+  short leftover = 0;
+  short rightover = 0;
+  char* play = diagnostic->source;
+  unsigned int play_length = diagnostic->source_length;
+  unsigned int offset = diagnostic->offset;
+
+  if(play_length > 80) {
+    if(offset < 40) {
+      rightover = 1;
+    }
+    else if(offset > play_length - 40) {
       play += play_length - 80;
       offset -= play_length - 80;
       leftover = 1;
@@ -457,12 +1285,116 @@ void syntaxError(char* comment, char* play, unsigned int play_length, unsigned i
     buffer[77] = '.';
   }
 
-  logMessage("Syntax Error: %s\n\"%s\"\n", comment, buffer);
+  logMessage("Syntax Error: %s\n\"%s\"\n%*s^\n", diagnostic->message, buffer, offset + 1, "");
+}
+
+static void flushCode(CodeBuffer* buffer);
+static inline void reserveCode(CodeBuffer* buffer, size_t size);
+static void putCode(CodeBuffer* buffer, const char* text);
+static void printCode(CodeBuffer* buffer, const char* format, ...);
+
+/**
+ * Internal function to append a string to a buffer as a JSON string.
+ */
+static void putJSONString(CodeBuffer* buffer, char* string, size_t length)
+{
+  static const char hex[] = "0123456789abcdef";
+  size_t i;
+  char* out;
+
+  reserveCode(buffer, 1);
+  buffer->data[buffer->length++] = '"';
+  for(i=0; i<length; i++) {
+    reserveCode(buffer, 6);
+    out = buffer->data + buffer->length;
+    if(string[i] == '"' || string[i] == '\\') {
+      out[0] = '\\';
+      out[1] = string[i];
+      buffer->length += 2;
+    }
+    else if((unsigned char)string[i] < 0x20) {
+      memcpy(out, "\\u00", 4);
+      out[4] = hex[(unsigned char)string[i] >> 4];
+      out[5] = hex[string[i] & 0xf];
+      buffer->length += 6;
+    }
+    else
+      buffer->data[buffer->length++] = string[i];
+  }
+  reserveCode(buffer, 1);
+  buffer->data[buffer->length++] = '"';
+}
+
+/**
+ * Prints and frees a list of diagnostics, followed by how many more
+ * there were if some were suppressed.  With json_diagnostics set,
+ * each diagnostic is printed as a JSON object on a line of its own,
+ * giving its severity and message and, for a syntax error, where it
+ * is: its offset into the statement, the line and column there (both
+ * counting from 1) and, if the statement is a sub-string, its name.
+ * The JSON objects are gathered in a buffer and written out together.
+ */
+void reportDiagnostics(Diagnostics* list)
+{
+  Diagnostic* diagnostic;
+  char* source = NULL;
+  unsigned int scanned = 0;
+  unsigned long line = 1, line_start = 0;
+  size_t length;
+  unsigned long i;
+  unsigned int j;
+  CodeBuffer buffer;
+
+  buffer.file = stderr;
+  buffer.length = 0;
+
+  for(i=0; i<list->num_items; i++) {
+    diagnostic = &list->items[i];
+    if(!json_diagnostics) {
+      if(diagnostic->severity == DIAGNOSTIC_ERROR)
+	printSyntaxError(diagnostic);
+      else
+	logMessage("WARNING: %s\n", diagnostic->message);
+      continue;
+    }
+
+    length = strlen(diagnostic->message);
+    if(length > 0 && diagnostic->message[length - 1] == ':')
+      length--;
+    printCode(&buffer, "{\"severity\":\"%s\",\"message\":", (diagnostic->severity == DIAGNOSTIC_ERROR) ? "error" : "warning");
+    putJSONString(&buffer, diagnostic->message, length);
+    if(diagnostic->source != NULL) {
+      /* diagnostics are mostly in order, so lines are counted on from the last one */
+      if(diagnostic->source != source || diagnostic->offset < scanned) {
+	source = diagnostic->source;
+	scanned = 0;
+	line = 1;
+	line_start = 0;
+      }
+      for(; scanned < diagnostic->offset && scanned < diagnostic->source_length; scanned++) {
+	if(source[scanned] == '\n') {
+	  line++;
+	  line_start = scanned + 1;
+	}
+      }
+      for(j=0; j<num_substrings && substrings[j].play != source; j++);
+      if(j < num_substrings) {
+	putCode(&buffer, ",\"substring\":");
+	putJSONString(&buffer, substrings[j].name, strlen(substrings[j].name));
+      }
+      printCode(&buffer, ",\"offset\":%u,\"line\":%lu,\"column\":%lu", diagnostic->offset, line, diagnostic->offset - line_start + 1);
+    }
+    putCode(&buffer, "}\n");
+  }
 
-  for(i=0; i<=offset; i++) {
-    logMessage(" ");
+  if(list->num_suppressed > 0) {
+    if(json_diagnostics)
+      printCode(&buffer, "{\"severity\":\"note\",\"message\":\"more errors and warnings were not shown\",\"suppressed\":%lu}\n", list->num_suppressed);
+    else
+      logMessage("%lu more errors and warnings were not shown; use -maxerrors to show more.\n", list->num_suppressed);
   }
-  logMessage("^\n");
+  flushCode(&buffer);
+  freeDiagnostics(list);
 }
 
 /**
@@ -484,26 +1416,60 @@ void addNote(int code, int value, Note** current_note, Note** last_note) {
   *current_note = NULL;
 }
 
-unsigned long parsePlayStatement(char* play, unsigned int play_length, Note* first_note)
+/**
+ * Sets a parse state to the state at the start of every PLAY
+ * statement.
+ */
+void initParseState(ParseState* state)
 {
-  unsigned long num_notes = 0;
-  int code = CODE_ERROR;
-  int value = 0;
+  state->code = CODE_ERROR;
+  state->value = 0;
+  state->code_set = 0;
+  state->number_sequence_length = 0;
+  state->last_octave = 0;
+  state->last_duration = 4;
+  state->octave_known = 1;
+  state->duration_known = 1;
+}
+
+int findSubstring(char* name, size_t name_length);
+int parseSubstring(unsigned int index);
+
+/**
+ * Parses the characters of a PLAY statement from offset begin up to
+ * offset end, appending the notes to a notes linked list in the same
+ * way as addNote().  The whole statement is passed so that syntax
+ * errors can show their context.  state holds the parse state in
+ * effect before begin and is updated as the characters are read.
+ * Returns the offset at which parsing stopped, which may lie past end
+ * if the last command read ahead.
+ *
+ * If the state's octave_known or duration_known flag is cleared, the
+ * octave or note length in effect before begin is unknown.  Notes
+ * depending on it are then added with CODE_RELATIVE set, and are
+ * resolved later by resolveNotes().
+ */
+unsigned int parseRange(ParseState* state, char* play, unsigned int play_length, unsigned int begin, unsigned int end,
+			Note** current_note_ptr, Note** last_note_ptr, unsigned long* num_notes_ptr)
+{
+  unsigned long num_notes = *num_notes_ptr;
+  int code = state->code;
+  int value = state->value;
   int lastvalue;
-  short last_octave = 0;
-  short last_duration = 4;
-  short code_set = 0;
+  short last_octave = state->last_octave;
+  short last_duration = state->last_duration;
+  short code_set = state->code_set;
   unsigned int i, j;
-  Note* last_note = NULL;
-  Note* current_note = first_note;
+  Note* last_note = *last_note_ptr;
+  Note* current_note = *current_note_ptr;
   char curr_char, next_char, nextnext_char;
-  short number_sequence_length = 0;
-  int number_sequence[MAX_NUMBER_SEQUENCE_LENGTH];
-
-  if(first_note != NULL)
-    first_note->code = CODE_ERROR;
+  unsigned int name_length;
+  long repeat;
+  int substring;
+  short number_sequence_length = state->number_sequence_length;
+  int* number_sequence = state->number_sequence;
 
-  for(i=0; i<play_length; i++) {
+  for(i=begin; i<end; i++) {
     curr_char = play[i];
     if(i < play_length - 1) {
       next_char = play[i+1];
@@ -545,10 +1511,10 @@ unsigned long parsePlayStatement(char* play, unsigned int play_length, Note* fir
 	  code = CODE_L4_PER_MINUTE;
 	  break;
 	case '>':
-	  addNote(CODE_OCTAVE, ++last_octave, &current_note, &last_note);
+	  addNote(state->octave_known ? CODE_OCTAVE : CODE_OCTAVE | CODE_RELATIVE, ++last_octave, &current_note, &last_note);
 	  break;
 	case '<':
-	  addNote(CODE_OCTAVE, --last_octave, &current_note, &last_note);
+	  addNote(state->octave_known ? CODE_OCTAVE : CODE_OCTAVE | CODE_RELATIVE, --last_octave, &current_note, &last_note);
 	  break;
 	}
 	if(curr_char != '>' && curr_char != '<')
@@ -558,6 +1524,60 @@ unsigned long parsePlayStatement(char* play, unsigned int play_length, Note* fir
 	syntaxError("Command not expected:", play, play_length, i);
       }
     }
+    else if(curr_char == 'x' || curr_char == 'X') {
+      /**
+       * Execute a sub-string: X, the sub-string's name, optionally '*'
+       * and the number of times to play it, and a semicolon.
+       */
+      if(code_set) {
+	syntaxError("Command not expected:", play, play_length, i);
+	continue;
+      }
+      for(j=i+1; j<play_length && (isalnum((unsigned char)play[j]) || play[j] == '_'); j++);
+      name_length = j - i - 1;
+      if(j < play_length && play[j] == '$')
+	j++;
+      repeat = 1;
+      if(j < play_length && play[j] == '*') {
+	repeat = 0;
+	for(j++; j<play_length && play[j] >= '0' && play[j] <= '9'; j++) {
+	  if(repeat > 0x7fffffff / 10) {
+	    syntaxError("Numbers too big (number will be trunctuated):", play, play_length, j);
+	    continue;
+	  }
+	  repeat = 10 * repeat + (play[j] - '0');
+	}
+      }
+      if(j >= play_length || play[j] != ';') {
+	syntaxError("';' expected after sub-string:", play, play_length, (j < play_length) ? j : play_length - 1);
+	continue;
+      }
+      substring = findSubstring(play + i + 1, name_length);
+      if(substring < 0) {
+	syntaxError("Unknown sub-string:", play, play_length, i + 1);
+      }
+      else if(parseSubstring(substring) < 0) {
+	syntaxError("Sub-string executes itself:", play, play_length, i + 1);
+      }
+      else if(repeat > 0) {
+	if(repeat != 1)
+	  addNote(CODE_REPEAT, repeat, &current_note, &last_note);
+	addNote(CODE_EXECUTE, substring, &current_note, &last_note);
+	num_notes += repeat * substrings[substring].num_notes;
+	if(substrings[substring].state.octave_known) {
+	  last_octave = substrings[substring].state.last_octave;
+	  state->octave_known = 1;
+	}
+	else {
+	  last_octave = (short)(last_octave + repeat * substrings[substring].state.last_octave);
+	}
+	if(substrings[substring].state.duration_known) {
+	  last_duration = substrings[substring].state.last_duration;
+	  state->duration_known = 1;
+	}
+      }
+      i = j;
+    }
     else if(curr_char == 'm' || curr_char == 'M') {
       i++;
       switch(next_char) {
@@ -680,132 +1700,2956 @@ unsigned long parsePlayStatement(char* play, unsigned int play_length, Note* fir
 
       lastvalue = value;
       value = 0;
-      for(j=0; j<number_sequence_length; j++)
+      for(j=0; j<(unsigned int)number_sequence_length; j++)
 	value += power_of_ten[number_sequence_length - j - 1] * number_sequence[j];
 
-      if(code == CODE_PAUSE || code & CODE_PAUSE)
-	num_notes++;
-      else if(code & CODE_OCTAVE) {
-	last_octave = value;
-      }
-      else if(code & CODE_DURATION) {
-	last_duration = value;
-      }
+      if(code == CODE_PAUSE || code & CODE_PAUSE)
+	num_notes++;
+      else if(code & CODE_OCTAVE) {
+	last_octave = value;
+	state->octave_known = 1;
+      }
+      else if(code & CODE_DURATION) {
+	last_duration = value;
+	state->duration_known = 1;
+      }
+
+      if(code & CODE_NOTE) {
+	/**
+	 * This note has a duration in and of itself.
+	 */
+	addNote(CODE_DURATION, value, &current_note, &last_note);
+	addNote(code, lastvalue, &current_note, &last_note);
+	if(state->duration_known)
+	  addNote(CODE_DURATION, last_duration, &current_note, &last_note);
+	else
+	  addNote(CODE_DURATION | CODE_RELATIVE, 0, &current_note, &last_note);
+      }
+      else {
+	addNote(code, value, &current_note, &last_note);
+      }
+      code_set = 0;
+      number_sequence_length = 0;
+    }
+    else if(curr_char == ' ') {
+
+    }
+    else {
+      syntaxError("Symbol not expected:", play, play_length, i);
+    }
+  }
+
+  state->code = code;
+  state->value = value;
+  state->code_set = code_set;
+  state->number_sequence_length = number_sequence_length;
+  state->last_octave = last_octave;
+  state->last_duration = last_duration;
+  *current_note_ptr = current_note;
+  *last_note_ptr = last_note;
+  *num_notes_ptr = num_notes;
+
+  return i;
+}
+
+/**
+ * Defines a named sub-string from an argument of the form
+ * NAME=statement.  A '$' after the name, as in BASIC, is allowed and
+ * ignored.  Returns 0 on success.
+ */
+int defineSubstring(char* definition)
+{
+  char* equals = strchr(definition, '=');
+  Substring* table;
+  size_t name_length;
+  unsigned int i;
+
+  if(equals == NULL || equals == definition)
+    return -1;
+  name_length = equals - definition;
+  if(definition[name_length - 1] == '$')
+    name_length--;
+  for(i=0; i<name_length; i++) {
+    if(!isalnum((unsigned char)definition[i]) && definition[i] != '_')
+      return -1;
+  }
+  if(name_length == 0 || findSubstring(definition, name_length) >= 0)
+    return -1;
+
+  table = (Substring*)realloc(substrings, sizeof(Substring) * (num_substrings + 1));
+  if(table == NULL)
+    return -1;
+  substrings = table;
+  memset(&substrings[num_substrings], 0, sizeof(Substring));
+  substrings[num_substrings].name = (char*)malloc(sizeof(char) * (name_length + 1));
+  strncpy(substrings[num_substrings].name, definition, name_length);
+  substrings[num_substrings].name[name_length] = '\0';
+  substrings[num_substrings].play = equals + 1;
+  num_substrings++;
+  return 0;
+}
+
+/**
+ * Returns the index of the sub-string with the given name (ignoring
+ * case), or -1 if there is none.
+ */
+int findSubstring(char* name, size_t name_length)
+{
+  unsigned int i;
+
+  for(i=0; i<num_substrings; i++) {
+    if(strlen(substrings[i].name) == name_length && strncasecmp(substrings[i].name, name, name_length) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/**
+ * Parses a sub-string, if it has not been parsed already.  Sub-strings
+ * are parsed without knowing the octave and note length they will be
+ * played with, as with the chunks of parseToFrequency().  Returns -1
+ * if the sub-string is already being parsed, i.e. it executes itself.
+ */
+int parseSubstring(unsigned int index)
+{
+  Substring* substring = &substrings[index];
+  Note* current_note;
+  Note* last_note = NULL;
+
+  if(substring->status == SUBSTRING_PARSING)
+    return -1;
+  if(substring->status == SUBSTRING_PARSED)
+    return 0;
+
+  substring->status = SUBSTRING_PARSING;
+  initParseState(&substring->state);
+  substring->state.octave_known = 0;
+  substring->state.duration_known = 0;
+  current_note = substring->notes = (Note*)malloc(sizeof(Note));
+  parseRange(&substring->state, substring->play, strlen(substring->play), 0, strlen(substring->play),
+	     &current_note, &last_note, &substring->num_notes);
+  if(current_note != NULL) {
+    /* no notes were added */
+    free(current_note);
+    substring->notes = NULL;
+  }
+  substring->status = SUBSTRING_PARSED;
+  return 0;
+}
+
+/**
+ * Deletes all sub-strings
+ */
+void freeSubstrings()
+{
+  unsigned int i;
+
+  for(i=0; i<num_substrings; i++) {
+    free(substrings[i].name);
+    freeNotes(substrings[i].notes);
+  }
+  free(substrings);
+  substrings = NULL;
+  num_substrings = 0;
+}
+
+/**
+ * Parses a PLAY statement into a linked list of notes.  Returns the
+ * number of notes.
+ *
+ * play        - the PLAY statement
+ * play_length - length of the PLAY statement
+ * first_note  - pointer to what is to be the head of the new notes
+ *               linked list.  Note that the value of the head will be set;
+ *               any value it currently has will be overwritten.
+ */
+unsigned long parsePlayStatement(char* play, unsigned int play_length, Note* first_note)
+{
+  ParseState state;
+  unsigned long num_notes = 0;
+  Note* last_note = NULL;
+  Note* current_note = first_note;
+
+  if(first_note != NULL) {
+    first_note->code = CODE_ERROR;
+    first_note->next = NULL;
+  }
+
+  initParseState(&state);
+  parseRange(&state, play, play_length, 0, play_length, &current_note, &last_note, &num_notes);
+
+  return num_notes;
+}
+
+/**
+ * Runs routine on each of num_items items of item_size bytes, one
+ * thread per item, and waits for all of them to finish.  If a thread
+ * cannot be created, its item is run on the calling thread instead.
+ */
+void runInParallel(void* (*routine)(void*), void* items, size_t item_size, unsigned int num_items)
+{
+  pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * num_items);
+  char* created = (char*)calloc(num_items, sizeof(char));
+  unsigned int i;
+
+  for(i=1; i<num_items; i++) {
+    if(threads != NULL && created != NULL &&
+       pthread_create(&threads[i], NULL, routine, (char*)items + i * item_size) == 0)
+      created[i] = 1;
+  }
+  for(i=0; i<num_items; i++) {
+    if(i == 0 || created == NULL || !created[i])
+      routine((char*)items + i * item_size);
+  }
+  for(i=1; i<num_items; i++) {
+    if(created != NULL && created[i])
+      pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  free(created);
+}
+
+#define PARALLEL_PARSE_MINIMUM (1 << 20) /* statements shorter than this are parsed serially */
+
+/**
+ * A piece of a PLAY statement that is parsed and converted to
+ * frequencies independently of the others.
+ */
+typedef struct tagParseChunk
+{
+  char* play;
+  unsigned int play_length;
+  unsigned int begin;
+  unsigned int end;
+  unsigned int stop;             /* offset at which parsing actually stopped */
+  ParseState start_state;        /* parse state before the chunk, once resolved */
+  ParseState state;              /* parse state after the chunk */
+  Note* first_note;
+  Note* last_note;
+  unsigned long num_notes;
+  Note* last_octave;             /* last note of each kind that changes the music state */
+  Note* last_duration;
+  Note* last_l4_per_minute;
+  Note* last_music;
+  Note* last_pitch;              /* last note that names a pitch ... */
+  Note* pitch_octave;            /* ... and the last octave note before it */
+  short has_execute;             /* if set, the chunk plays a sub-string */
+  MusicState music;              /* music state before the chunk */
+  Song song;
+  Diagnostics syntax_errors;
+  Diagnostics warnings;
+} ParseChunk;
+
+/**
+ * Parses a chunk from its current state, replacing any notes it
+ * already had.  Returns the offset at which parsing stopped.
+ */
+unsigned int parseChunkRange(ParseChunk* chunk)
+{
+  Note* current_note = (Note*)malloc(sizeof(Note));
+  unsigned int stop;
+
+  freeNotes(chunk->first_note);
+  chunk->first_note = current_note;
+  chunk->last_note = NULL;
+  chunk->num_notes = 0;
+  stop = parseRange(&chunk->state, chunk->play, chunk->play_length, chunk->begin, chunk->end,
+		    &current_note, &chunk->last_note, &chunk->num_notes);
+  if(current_note != NULL) {
+    /* no notes were added */
+    free(current_note);
+    chunk->first_note = NULL;
+  }
+  return stop;
+}
+
+/**
+ * Parses a chunk assuming nothing about the octave and note length
+ * in effect before it.  The first chunk starts at the beginning of
+ * the statement, so its state is known.
+ */
+void* parseChunk(void* argument)
+{
+  ParseChunk* chunk = (ParseChunk*)argument;
+
+  initParseState(&chunk->state);
+  if(chunk->begin > 0) {
+    chunk->state.last_octave = 0;
+    chunk->state.octave_known = 0;
+    chunk->state.duration_known = 0;
+  }
+  diagnostics = &chunk->syntax_errors;
+  chunk->stop = parseChunkRange(chunk);
+  diagnostics = &all_diagnostics;
+  return NULL;
+}
+
+/**
+ * Resolves the notes of a chunk that depend on the state before it,
+ * and finds the notes that determine the music state after it.
+ */
+void* resolveChunk(void* argument)
+{
+  ParseChunk* chunk = (ParseChunk*)argument;
+  Note* note;
+
+  for(note = chunk->first_note; note != NULL; note = note->next) {
+    if(note->code & CODE_RELATIVE) {
+      note->code &= ~CODE_RELATIVE;
+      if(note->code & CODE_OCTAVE)
+	note->value = (short)(chunk->start_state.last_octave + note->value);
+      else
+	note->value = chunk->start_state.last_duration;
+    }
+    if(note->code & CODE_EXECUTE) {
+      chunk->has_execute = 1;
+    }
+    else if(note->code & CODE_NOTE) {
+      if(note->value & ~(NOTE_FLAT | NOTE_SHARP)) {
+	chunk->last_pitch = note;
+	chunk->pitch_octave = chunk->last_octave;
+      }
+    }
+    else if(note->code & CODE_L4_PER_MINUTE)
+      chunk->last_l4_per_minute = note;
+    else if(note->code & CODE_DURATION)
+      chunk->last_duration = note;
+    else if(note->code & CODE_OCTAVE)
+      chunk->last_octave = note;
+    else if(note->code & CODE_MUSIC)
+      chunk->last_music = note;
+  }
+  return NULL;
+}
+
+/**
+ * Converts the notes of a chunk to frequencies, starting from the
+ * music state in effect before it.
+ */
+void* convertChunk(void* argument)
+{
+  ParseChunk* chunk = (ParseChunk*)argument;
+  MusicState state = chunk->music;
+
+  diagnostics = &chunk->warnings;
+  convertNotes(chunk->first_note, NULL, &state, &chunk->song, &chunk->song);
+  diagnostics = &all_diagnostics;
+  return NULL;
+}
+
+/**
+ * Advances a music state over a whole chunk, without visiting any
+ * note other than those found by resolveChunk().
+ */
+void skipChunk(MusicState* state, ParseChunk* chunk)
+{
+  MusicState at_pitch;
+
+  if(chunk->last_pitch != NULL) {
+    at_pitch = *state;
+    if(chunk->pitch_octave != NULL)
+      updateMusicState(&at_pitch, chunk->pitch_octave, 0);
+    state->pitch = notePitch(chunk->last_pitch->value, at_pitch.octave, state->pitch);
+  }
+  if(chunk->last_octave != NULL)
+    updateMusicState(state, chunk->last_octave, 0);
+  if(chunk->last_duration != NULL)
+    updateMusicState(state, chunk->last_duration, 0);
+  if(chunk->last_l4_per_minute != NULL)
+    updateMusicState(state, chunk->last_l4_per_minute, 0);
+  if(chunk->last_music != NULL)
+    updateMusicState(state, chunk->last_music, 0);
+}
+
+/**
+ * Parses a PLAY statement and converts it to a linked list of
+ * frequencies, exactly as parsePlayStatement() followed by
+ * notesToFrequency() would.  Long statements are split into
+ * num_threads chunks that are parsed in parallel; the octave, note
+ * length, tempo and music mode at the start of each chunk are then
+ * found by scanning the chunks in order, and the chunks are converted
+ * to frequencies in parallel.  Returns the total number of samples.
+ *
+ * song      - pointer to the song to fill in, as for notesToFrequency()
+ * num_notes - set to the number of notes
+ */
+unsigned long long parseToFrequency(char* play, unsigned int play_length, unsigned int num_threads, Song* song, unsigned long* num_notes)
+{
+  ParseChunk* chunks = NULL;
+  ParseChunk* chunk;
+  ParseChunk* previous;
+  ParseState state;
+  MusicState music;
+  Note* notes;
+  unsigned long long total_samples = 0;
+  unsigned long num_frequencies = 0;
+  short executes = 0;
+  unsigned int i, split;
+  char c;
+
+  if(num_threads > 1 && play_length >= PARALLEL_PARSE_MINIMUM)
+    chunks = (ParseChunk*)calloc(num_threads, sizeof(ParseChunk));
+
+  if(chunks == NULL) {
+    notes = (Note*)malloc(sizeof(Note));
+    *num_notes = parsePlayStatement(play, play_length, notes);
+    total_samples = notesToFrequency(notes, song);
+    freeNotes(notes);
+    return total_samples;
+  }
+
+  /**
+   * Split the statement just before notes that do not follow a
+   * command expecting a value.  This is only a guess at where
+   * commands begin: a chunk that turns out to start in the middle of
+   * a command is simply parsed again below.
+   */
+  for(i=0; i<num_threads; i++) {
+    chunk = &chunks[i];
+    chunk->play = play;
+    chunk->play_length = play_length;
+    chunk->begin = (i == 0) ? 0 : chunks[i-1].end;
+    split = (i == num_threads - 1) ? play_length : (unsigned int)((unsigned long long)play_length * (i + 1) / num_threads);
+    if(split < chunk->begin)
+      split = chunk->begin;
+    for(; split > 0 && split < play_length; split++) {
+      c = play[split - 1];
+      if(((play[split] >= 'A' && play[split] <= 'G') || (play[split] >= 'a' && play[split] <= 'g')) &&
+	 strchr("LlOoPpTtMmXx", c) == NULL)
+	break;
+    }
+    chunk->end = split;
+  }
+
+  runInParallel(parseChunk, chunks, sizeof(ParseChunk), num_threads);
+
+  /**
+   * Find the parse state before each chunk.  If a chunk did not start
+   * where its predecessor stopped, or its predecessor stopped in the
+   * middle of a command, re-parse it from the correct state.
+   */
+  for(i=1; i<num_threads; i++) {
+    chunk = &chunks[i];
+    previous = &chunks[i-1];
+    chunk->start_state = previous->state;
+    if(previous->stop != chunk->begin || previous->state.code_set || previous->state.number_sequence_length) {
+      freeDiagnostics(&chunk->syntax_errors);
+      chunk->begin = previous->stop;
+      if(chunk->end < chunk->begin)
+	chunk->end = chunk->begin;
+      chunk->state = previous->state;
+      diagnostics = &chunk->syntax_errors;
+      chunk->stop = parseChunkRange(chunk);
+      diagnostics = &all_diagnostics;
+    }
+    else {
+      /* The command the chunk stopped in is its own, but the octave
+	 and note length it was relative to come from before it */
+      state = chunk->state;
+      chunk->state = previous->state;
+      chunk->state.code = state.code;
+      chunk->state.value = state.value;
+      chunk->state.code_set = state.code_set;
+      chunk->state.number_sequence_length = state.number_sequence_length;
+      memcpy(chunk->state.number_sequence, state.number_sequence, sizeof(state.number_sequence));
+      if(state.octave_known)
+	chunk->state.last_octave = state.last_octave;
+      else
+	chunk->state.last_octave = (short)(previous->state.last_octave + state.last_octave);
+      if(state.duration_known)
+	chunk->state.last_duration = state.last_duration;
+    }
+  }
+
+  runInParallel(resolveChunk, chunks, sizeof(ParseChunk), num_threads);
+
+  for(i=0; i<num_threads; i++)
+    executes |= chunks[i].has_execute;
+
+  initMusicState(&music);
+  if(executes) {
+    /**
+     * A sub-string may change any part of the music state, so the
+     * state before a chunk is only known once the chunks before it
+     * have been converted.  Convert them in order, all into the first
+     * chunk's song so that they share its phrases.
+     */
+    for(i=0; i<num_threads; i++) {
+      diagnostics = &chunks[i].warnings;
+      convertNotes(chunks[i].first_note, NULL, &music, &chunks[0].song, &chunks[0].song);
+      diagnostics = &all_diagnostics;
+    }
+  }
+  else {
+    for(i=0; i<num_threads; i++) {
+      chunks[i].music = music;
+      skipChunk(&music, &chunks[i]);
+    }
+
+    runInParallel(convertChunk, chunks, sizeof(ParseChunk), num_threads);
+  }
+
+  *num_notes = 0;
+  for(i=0; i<num_threads; i++) {
+    appendDiagnostics(&all_diagnostics, &chunks[i].syntax_errors);
+    num_frequencies += chunks[i].song.num_frequencies;
+  }
+  song->num_frequencies = 0;
+  song->total_samples = 0;
+  if(song->capacity < num_frequencies) {
+    free(song->frequencies);
+    song->capacity = num_frequencies;
+    song->frequencies = (Frequency*)malloc(sizeof(Frequency) * num_frequencies);
+    if(song->frequencies == NULL) {
+      logMessage("ERROR: Could not allocate enough memory!\n");
+      exit(-3);
+    }
+  }
+  for(i=0; i<num_threads; i++) {
+    chunk = &chunks[i];
+    appendDiagnostics(&all_diagnostics, &chunk->warnings);
+    *num_notes += chunk->num_notes;
+    memcpy(song->frequencies + song->num_frequencies, chunk->song.frequencies, sizeof(Frequency) * chunk->song.num_frequencies);
+    song->num_frequencies += chunk->song.num_frequencies;
+    song->total_samples += chunk->song.total_samples;
+    if(i == 0) {
+      song->phrases = chunk->song.phrases;
+      song->num_phrases = chunk->song.num_phrases;
+      song->phrase_capacity = chunk->song.phrase_capacity;
+      chunk->song.phrases = NULL;
+      chunk->song.num_phrases = 0;
+    }
+    freeSong(&chunk->song);
+    freeNotes(chunk->first_note);
+  }
+  free(chunks);
+  total_samples = song->total_samples;
+
+  return total_samples;
+}
+
+/**
+ * Synthesizes samples samples of a tone at frequency hertz as 16-bit
+ * little-endian PCM at pcm, starting from the tone's sample first.
+ * Returns the address just past the last sample written.
+ */
+unsigned char* renderSound(unsigned char* pcm, unsigned long long first, unsigned long long samples, double frequency)
+{
+  unsigned long long i;
+  short v;
+  for(i=first; i<first+samples; i++) {
+    v = (short)(WAVE_AMPLITUDE * sin(2.0 * PI * ((double)(i))*frequency/(double)SAMPLE_RATE));
+    *pcm++ = (v & 0x00ff);
+    *pcm++ = (v & 0xff00) >> 8;
+  }
+  return pcm;
+}
+
+/**
+ * Internal function to check whether frequencies contain a silence of
+ * at least WAVE_HOLE_SIZE bytes, either of their own or inside one of
+ * the phrases marked in silent.
+ */
+static int hasLongSilence(Frequency* frequencies, unsigned long num_frequencies, Song* song, char* silent)
+{
+  unsigned long i, index;
+  unsigned long long silence = 0;
+
+  for(i=0; i<num_frequencies; i++) {
+    if(FREQUENCY_IS_PHRASE(frequencies[i])) {
+      index = PHRASE_INDEX(frequencies[i]);
+      if(PHRASE_COUNT(frequencies[i]) == 0 || song->phrases[index].total_samples == 0)
+	continue;
+      if(silent[index])
+	return 1;
+      silence = 0;
+    }
+    else if(FREQUENCY_PITCH(frequencies[i]) == PITCH_SILENCE) {
+      silence += FREQUENCY_SAMPLES(frequencies[i]);
+      if(2 * silence >= WAVE_HOLE_SIZE)
+	return 1;
+    }
+    else if(!FREQUENCY_IS_TEMPO(frequencies[i]) && FREQUENCY_SAMPLES(frequencies[i]) > 0)
+      silence = 0;
+  }
+  return 0;
+}
+
+/**
+ * Finds which of a song's phrases contain a silence long enough to be
+ * left as a hole.  A phrase only refers to the phrases before it, so
+ * they can be checked in order.  Returns an array with a flag for each
+ * phrase.
+ */
+char* findSilentPhrases(Song* song)
+{
+  unsigned long i;
+  char* silent = (char*)calloc(song->num_phrases + 1, 1);
+
+  if(silent == NULL) {
+    logMessage("ERROR: Could not allocate enough memory!\n");
+    exit(-3);
+  }
+  for(i=0; i<song->num_phrases; i++)
+    silent[i] = hasLongSilence(song->phrases[i].frequencies, song->phrases[i].num_frequencies, song, silent);
+  return silent;
+}
+
+/**
+ * Copies an earlier rendering of frequencies from source to pcm,
+ * skipping the silences, which are already zero at pcm.  Phrases
+ * without long silences are copied whole.
+ */
+void copyFrequencies(unsigned char* pcm, unsigned char* source, Frequency* frequencies, unsigned long num_frequencies, Song* song, char* silent)
+{
+  unsigned long i, count, index;
+  size_t size;
+
+  for(i=0; i<num_frequencies; i++) {
+    if(FREQUENCY_IS_PHRASE(frequencies[i])) {
+      index = PHRASE_INDEX(frequencies[i]);
+      size = 2 * (size_t)song->phrases[index].total_samples;
+      for(count = PHRASE_COUNT(frequencies[i]); count > 0; count--) {
+	if(silent[index])
+	  copyFrequencies(pcm, source, song->phrases[index].frequencies, song->phrases[index].num_frequencies, song, silent);
+	else
+	  memcpy(pcm, source, size);
+	pcm += size;
+	source += size;
+      }
+    }
+    else if(!FREQUENCY_IS_TEMPO(frequencies[i])) {
+      size = 2 * (size_t)FREQUENCY_SAMPLES(frequencies[i]);
+      if(FREQUENCY_PITCH(frequencies[i]) != PITCH_SILENCE)
+	memcpy(pcm, source, size);
+      pcm += size;
+      source += size;
+    }
+  }
+}
+
+/**
+ * Renders frequencies as 16-bit PCM at pcm, which must already be
+ * zero: silences are skipped rather than synthesized.  Every note
+ * starts at the same phase, so a phrase always renders to the same
+ * samples: it is synthesized only the first time it is played, and
+ * copied from there every time after.  Returns the address just past
+ * the last sample written.
+ *
+ * song     - the song whose phrases the frequencies refer to
+ * rendered - for each of the song's phrases, where it was first
+ *            rendered, or NULL if it has not been yet
+ * silent   - for each of the song's phrases, whether it contains a
+ *            long silence, which copying it must not touch
+ */
+unsigned char* renderFrequencies(unsigned char* pcm, Frequency* frequencies, unsigned long num_frequencies, Song* song, unsigned char** rendered, char* silent)
+{
+  unsigned long i, count, index;
+  size_t size;
+
+  for(i=0; i<num_frequencies; i++) {
+    if(FREQUENCY_IS_PHRASE(frequencies[i])) {
+      index = PHRASE_INDEX(frequencies[i]);
+      count = PHRASE_COUNT(frequencies[i]);
+      size = 2 * (size_t)song->phrases[index].total_samples;
+      if(rendered[index] == NULL && count > 0) {
+	rendered[index] = pcm;
+	pcm = renderFrequencies(pcm, song->phrases[index].frequencies, song->phrases[index].num_frequencies, song, rendered, silent);
+	count--;
+      }
+      for(; count > 0; count--) {
+	if(silent[index])
+	  copyFrequencies(pcm, rendered[index], song->phrases[index].frequencies, song->phrases[index].num_frequencies, song, silent);
+	else
+	  memcpy(pcm, rendered[index], size);
+	pcm += size;
+      }
+    }
+    else if(FREQUENCY_PITCH(frequencies[i]) == PITCH_SILENCE)
+      pcm += 2 * (size_t)FREQUENCY_SAMPLES(frequencies[i]);
+    else if(!FREQUENCY_IS_TEMPO(frequencies[i]))
+      pcm = renderSound(pcm, 0, FREQUENCY_SAMPLES(frequencies[i]), FREQUENCY_HERTZ(frequencies[i]));
+  }
+  return pcm;
+}
+
+/**
+ * Renders a song to a complete WAVE file image at wave, which must be
+ * waveHeaderSize(song->total_samples) + 2 * song->total_samples bytes
+ * long and zero.
+ */
+void renderWave(unsigned char* wave, Song* song, char* silent)
+{
+  unsigned char** rendered = (unsigned char**)calloc(song->num_phrases + 1, sizeof(unsigned char*));
+
+  if(rendered == NULL) {
+    logMessage("ERROR: Could not allocate enough memory!\n");
+    exit(-3);
+  }
+  writeWaveHeader(wave, song->total_samples, SAMPLE_RATE);
+  renderFrequencies(wave + waveHeaderSize(song->total_samples), song->frequencies, song->num_frequencies, song, rendered, silent);
+  free(rendered);
+}
+
+/**
+ * Internal function to preallocate the audible run that ends at end.
+ */
+static void allocateRun(AudibleRun* run, unsigned long long end)
+{
+  int error;
+
+  if(run->error == 0 && end > run->start && (error = posix_fallocate(run->fd, (off_t)run->start, (off_t)(end - run->start))) != 0)
+    run->error = error;
+}
+
+/**
+ * Internal function to play size bytes of sound.  If they follow a
+ * long enough silence, the run before the silence is preallocated and
+ * a new one starts.
+ */
+static void playAudible(AudibleRun* run, unsigned long long size)
+{
+  if(run->position - run->silence_start >= WAVE_HOLE_SIZE) {
+    allocateRun(run, run->silence_start);
+    run->start = run->position;
+  }
+  run->position += size;
+  run->silence_start = run->position;
+}
+
+/**
+ * Walks frequencies the way renderFrequencies() writes them,
+ * preallocating every audible run of the file.  Phrases without long
+ * silences count as sound throughout, since they are copied whole.
+ */
+void allocateAudible(AudibleRun* run, Frequency* frequencies, unsigned long num_frequencies, Song* song, char* silent)
+{
+  unsigned long i, count, index;
+
+  for(i=0; i<num_frequencies; i++) {
+    if(FREQUENCY_IS_PHRASE(frequencies[i])) {
+      index = PHRASE_INDEX(frequencies[i]);
+      count = PHRASE_COUNT(frequencies[i]);
+      if(silent[index]) {
+	for(; count > 0; count--)
+	  allocateAudible(run, song->phrases[index].frequencies, song->phrases[index].num_frequencies, song, silent);
+      }
+      else if(count > 0 && song->phrases[index].total_samples > 0)
+	playAudible(run, 2 * count * song->phrases[index].total_samples);
+    }
+    else if(FREQUENCY_PITCH(frequencies[i]) == PITCH_SILENCE)
+      run->position += 2 * FREQUENCY_SAMPLES(frequencies[i]);
+    else if(!FREQUENCY_IS_TEMPO(frequencies[i]) && FREQUENCY_SAMPLES(frequencies[i]) > 0)
+      playAudible(run, 2 * FREQUENCY_SAMPLES(frequencies[i]));
+  }
+}
+
+/**
+ * Renders a WAVE file straight to disk.  Since the size of the file
+ * is known exactly beforehand, the file is sized and mapped into
+ * memory, and the samples are synthesized directly into the mapping.
+ * Only the audible runs are preallocated: silences of WAVE_HOLE_SIZE
+ * bytes or more are never touched, and stay holes in the file.
+ * Returns 0 on success.
+ */
+int writeWaveFile(char* filename, Song* song)
+{
+  unsigned long long bytes = waveHeaderSize(song->total_samples) + 2 * song->total_samples;
+  size_t size = (size_t)bytes;
+  unsigned char* wave;
+  char* silent;
+  AudibleRun run;
+  int fd;
+
+  /* the whole file is mapped, so it must fit in the address space */
+  if(size != bytes || (off_t)bytes < 0 || (unsigned long long)(off_t)bytes != bytes) {
+    logMessage("Error: %s would be %llu bytes, too large to map on this system!\n", filename, bytes);
+    return -1;
+  }
+  fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if(fd < 0) {
+    logMessage("Error: could not open %s for writing: %s\n", filename, strerror(errno));
+    return -1;
+  }
+  if(ftruncate(fd, (off_t)size) != 0) {
+    logMessage("Error: could not size %s to %llu bytes: %s\n", filename, bytes, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  silent = findSilentPhrases(song);
+  run.fd = fd;
+  run.error = 0;
+  run.start = 0;
+  run.silence_start = run.position = waveHeaderSize(song->total_samples);
+  allocateAudible(&run, song->frequencies, song->num_frequencies, song, silent);
+  if(run.position - run.silence_start >= WAVE_HOLE_SIZE)
+    allocateRun(&run, run.silence_start);
+  else
+    allocateRun(&run, run.position);
+  if(run.error != 0) {
+    logMessage("Error: could not allocate %llu bytes for %s: %s\n", bytes, filename, strerror(run.error));
+    free(silent);
+    close(fd);
+    return -1;
+  }
+  wave = (unsigned char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(wave == MAP_FAILED) {
+    logMessage("Error: could not map %s: %s\n", filename, strerror(errno));
+    free(silent);
+    close(fd);
+    return -1;
+  }
+
+  renderWave(wave, song, silent);
+
+  free(silent);
+  munmap(wave, size);
+  return close(fd);
+}
+
+static const unsigned char zero_block[WAVE_BLOCK_SIZE];
+
+/**
+ * Internal function to count the zero bytes at the start of data, in
+ * whole blocks of WAVE_BLOCK_SIZE bytes, or up to size.
+ */
+static size_t zeroBlocks(unsigned char* data, size_t size)
+{
+  size_t length = 0, block;
+
+  while(length < size) {
+    block = (size - length < WAVE_BLOCK_SIZE) ? size - length : WAVE_BLOCK_SIZE;
+    if(memcmp(data + length, zero_block, block) != 0)
+      break;
+    length += block;
+  }
+  return length;
+}
+
+static double monotonicSeconds(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/**
+ * Internal function to write all of size bytes of data to fd.
+ * Returns 0 on success.
+ */
+static int writeAll(int fd, const unsigned char* data, size_t size)
+{
+  ssize_t written;
+
+  while(size > 0) {
+    if((written = write(fd, data, size)) < 0) {
+      if(errno == EINTR)
+	continue;
+      return -1;
+    }
+    data += written;
+    size -= written;
+  }
+  return 0;
+}
+
+/**
+ * Internal function to write out the zero bytes the writer has passed
+ * over.  A hole of at least WAVE_HOLE_SIZE bytes is seeked over
+ * instead when the file allows it.
+ */
+static void writeRingHole(Ring* ring)
+{
+  size_t size;
+
+  if(ring->hole >= WAVE_HOLE_SIZE && ring->sparse) {
+    if(lseek(ring->fd, (off_t)ring->hole, SEEK_CUR) < 0)
+      atomic_store(&ring->error, 1);
+    ring->hole = 0;
+  }
+  for(; ring->hole > 0; ring->hole -= size) {
+    size = (ring->hole < WAVE_BLOCK_SIZE) ? (size_t)ring->hole : WAVE_BLOCK_SIZE;
+    if(writeAll(ring->fd, zero_block, size) != 0)
+      atomic_store(&ring->error, 1);
+  }
+}
+
+/**
+ * Internal function to gift length bytes of a block to the pipe the
+ * ring writes to, then map fresh pages in place of the block, since
+ * the gifted ones now belong to the pipe.  If the pipe turns out not
+ * to take spliced pages before any have been spliced, the ring goes
+ * back to writing.  Returns 0 on success.
+ */
+static int spliceRingBlock(Ring* ring, unsigned char* block, size_t length)
+{
+#ifdef __linux__
+  unsigned char* data = block;
+  struct iovec iov;
+  ssize_t spliced;
+
+  while(length > 0) {
+    iov.iov_base = data;
+    iov.iov_len = length;
+    if((spliced = vmsplice(ring->fd, &iov, 1, SPLICE_F_GIFT)) < 0) {
+      if(errno == EINTR)
+	continue;
+      if(ring->spliced == 0 && (errno == EINVAL || errno == ENOSYS)) {
+	ring->splice = 0;
+	return writeAll(ring->fd, data, length);
+      }
+      return -1;
+    }
+    data += spliced;
+    length -= spliced;
+    ring->spliced += spliced;
+  }
+  if(mmap(block, RING_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+    return -1;
+  return 0;
+#else
+  ring->splice = 0;
+  return writeAll(ring->fd, data, length);
+#endif
+}
+
+/**
+ * Internal function to write a block of the ring to its file.  Zero
+ * bytes are held back until the next sound, so that long silences can
+ * be left as holes.
+ */
+static void writeRingBlock(Ring* ring, unsigned char* data, size_t length)
+{
+  size_t i = 0, audible, block;
+
+  if(atomic_load_explicit(&ring->error, memory_order_relaxed))
+    return;
+  if(ring->splice) {
+    if(spliceRingBlock(ring, data, length) != 0)
+      atomic_store(&ring->error, 1);
+    return;
+  }
+  if(!ring->sparse) {
+    if(writeAll(ring->fd, data, length) != 0)
+      atomic_store(&ring->error, 1);
+    return;
+  }
+  while(i < length) {
+    block = zeroBlocks(data + i, length - i);
+    ring->hole += block;
+    i += block;
+    for(audible = 0; i + audible < length; audible += block) {
+      block = (length - i - audible < WAVE_BLOCK_SIZE) ? length - i - audible : WAVE_BLOCK_SIZE;
+      if(zeroBlocks(data + i + audible, block) == block)
+	break;
+    }
+    if(audible > 0) {
+      writeRingHole(ring);
+      if(writeAll(ring->fd, data + i, audible) != 0)
+	atomic_store(&ring->error, 1);
+      i += audible;
+    }
+  }
+}
+
+/**
+ * The writer thread: writes the ring's blocks out in order until the
+ * renderer has finished and the ring is empty, giving each block back
+ * to the renderer once it is written.
+ */
+void* ringWriter(void* data)
+{
+  Ring* ring = (Ring*)data;
+  unsigned long written = 0;
+  double start;
+
+  for(;;) {
+    if(atomic_load(&ring->head) == written) {
+      if(atomic_load(&ring->finished) && atomic_load(&ring->head) == written)
+	break;
+      ring->writer_waits++;
+      start = monotonicSeconds();
+      pthread_mutex_lock(&ring->lock);
+      atomic_store(&ring->writer_waiting, 1);
+      while(atomic_load(&ring->head) == written && !atomic_load(&ring->finished))
+	pthread_cond_wait(&ring->wake, &ring->lock);
+      atomic_store(&ring->writer_waiting, 0);
+      pthread_mutex_unlock(&ring->lock);
+      ring->writer_wait_seconds += monotonicSeconds() - start;
+      continue;
+    }
+    writeRingBlock(ring, ring->blocks + (written % ring->depth) * RING_BLOCK_SIZE, ring->lengths[written % ring->depth]);
+    atomic_store(&ring->tail, ++written);
+    if(atomic_load(&ring->renderer_waiting)) {
+      pthread_mutex_lock(&ring->lock);
+      pthread_cond_broadcast(&ring->wake);
+      pthread_mutex_unlock(&ring->lock);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Internal function to get the next block for the renderer to fill,
+ * waiting for the writer if the ring is full.
+ */
+static unsigned char* nextRingBlock(Ring* ring)
+{
+  unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  double start;
+
+  if(head - atomic_load(&ring->tail) == ring->depth) {
+    ring->renderer_waits++;
+    start = monotonicSeconds();
+    pthread_mutex_lock(&ring->lock);
+    atomic_store(&ring->renderer_waiting, 1);
+    while(head - atomic_load(&ring->tail) == ring->depth)
+      pthread_cond_wait(&ring->wake, &ring->lock);
+    atomic_store(&ring->renderer_waiting, 0);
+    pthread_mutex_unlock(&ring->lock);
+    ring->renderer_wait_seconds += monotonicSeconds() - start;
+  }
+  return ring->blocks + (head % ring->depth) * RING_BLOCK_SIZE;
+}
+
+/**
+ * Internal function to hand the block the renderer has filled with
+ * length bytes over to the writer.
+ */
+static void fillRingBlock(Ring* ring, size_t length)
+{
+  unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+  if(!ring->threaded) {
+    writeRingBlock(ring, ring->blocks + (head % ring->depth) * RING_BLOCK_SIZE, length);
+    return;
+  }
+  ring->lengths[head % ring->depth] = length;
+  atomic_store(&ring->head, head + 1);
+  if(head + 1 - atomic_load(&ring->tail) > ring->peak)
+    ring->peak = head + 1 - atomic_load(&ring->tail);
+  if(atomic_load(&ring->writer_waiting)) {
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_broadcast(&ring->wake);
+    pthread_mutex_unlock(&ring->lock);
+  }
+}
+
+/**
+ * Internal function to move on to a new block once the current one is
+ * full.
+ */
+static void flushWaveStream(WaveStream* stream)
+{
+  fillRingBlock(stream->ring, stream->length);
+  stream->block = nextRingBlock(stream->ring);
+  stream->length = 0;
+}
+
+/**
+ * Internal function to stream size bytes of data, or of silence if
+ * data is NULL.
+ */
+static void streamBytes(WaveStream* stream, const unsigned char* data, unsigned long long size)
+{
+  size_t length;
+
+  while(size > 0) {
+    if(stream->length == RING_BLOCK_SIZE)
+      flushWaveStream(stream);
+    length = (size < RING_BLOCK_SIZE - stream->length) ? (size_t)size : RING_BLOCK_SIZE - stream->length;
+    if(data != NULL) {
+      memcpy(stream->block + stream->length, data, length);
+      data += length;
+    }
+    else
+      memset(stream->block + stream->length, 0, length);
+    stream->length += length;
+    size -= length;
+  }
+}
+
+/**
+ * Internal function to synthesize samples samples of a tone, starting
+ * from the tone's sample first, straight into the ring.
+ */
+static void streamSound(WaveStream* stream, unsigned long long first, unsigned long long samples, double frequency)
+{
+  unsigned long count;
+
+  for(; samples > 0; samples -= count) {
+    if(stream->length == RING_BLOCK_SIZE)
+      flushWaveStream(stream);
+    count = (RING_BLOCK_SIZE - stream->length) / 2;
+    if(count > samples)
+      count = samples;
+    renderSound(stream->block + stream->length, first, count, frequency);
+    stream->length += 2 * count;
+    first += count;
+  }
+}
+
+void streamFrequencies(WaveStream* stream, Frequency* frequencies, unsigned long num_frequencies);
+
+/**
+ * Internal function to stream count plays of a phrase, rendering it
+ * into the cache first if it fits.
+ */
+static void streamPhrase(WaveStream* stream, unsigned long index, unsigned long count)
+{
+  Song* song = stream->song;
+  unsigned long long size = 2 * song->phrases[index].total_samples;
+  unsigned char* buffer;
+
+  if(count == 0 || size == 0)
+    return;
+  if(stream->rendered[index] == NULL && size <= stream->cache_left &&
+     (buffer = (unsigned char*)calloc((size_t)size, 1)) != NULL) {
+    renderFrequencies(buffer, song->phrases[index].frequencies, song->phrases[index].num_frequencies, song, stream->rendered, stream->silent);
+    stream->rendered[index] = buffer;
+    stream->cached[index] = 1;
+    stream->cache_left -= (size_t)size;
+  }
+  for(; count > 0; count--) {
+    if(stream->rendered[index] != NULL)
+      streamBytes(stream, stream->rendered[index], size);
+    else
+      streamFrequencies(stream, song->phrases[index].frequencies, song->phrases[index].num_frequencies);
+  }
+}
+
+/**
+ * Streams frequencies through the ring, the way renderFrequencies()
+ * would render them.  Stops early if the writer has failed.
+ */
+void streamFrequencies(WaveStream* stream, Frequency* frequencies, unsigned long num_frequencies)
+{
+  unsigned long i;
+
+  for(i=0; i<num_frequencies; i++) {
+    if(atomic_load_explicit(&stream->ring->error, memory_order_relaxed))
+      return;
+    if(FREQUENCY_IS_PHRASE(frequencies[i]))
+      streamPhrase(stream, PHRASE_INDEX(frequencies[i]), PHRASE_COUNT(frequencies[i]));
+    else if(FREQUENCY_PITCH(frequencies[i]) == PITCH_SILENCE)
+      streamBytes(stream, NULL, 2 * FREQUENCY_SAMPLES(frequencies[i]));
+    else if(!FREQUENCY_IS_TEMPO(frequencies[i]))
+      streamSound(stream, 0, FREQUENCY_SAMPLES(frequencies[i]), FREQUENCY_HERTZ(frequencies[i]));
+  }
+}
+
+/**
+ * Returns the timeline of a song or phrase: for each of its
+ * frequencies, the number of samples played before it, followed by
+ * its total_samples.  It is built the first time it is needed.
+ *
+ * root - the song whose phrases the frequencies refer to
+ */
+unsigned long long* songTimeline(Song* song, Song* root)
+{
+  unsigned long i;
+  unsigned long long samples = 0;
+  Frequency frequency;
+
+  if(song->timeline != NULL)
+    return song->timeline;
+  song->timeline = (unsigned long long*)malloc(sizeof(unsigned long long) * (song->num_frequencies + 1));
+  if(song->timeline == NULL) {
+    logMessage("ERROR: Could not allocate enough memory!\n");
+    exit(-3);
+  }
+  for(i=0; i<song->num_frequencies; i++) {
+    song->timeline[i] = samples;
+    frequency = song->frequencies[i];
+    if(FREQUENCY_IS_PHRASE(frequency))
+      samples += (unsigned long long)PHRASE_COUNT(frequency) * root->phrases[PHRASE_INDEX(frequency)].total_samples;
+    else if(!FREQUENCY_IS_TEMPO(frequency))
+      samples += FREQUENCY_SAMPLES(frequency);
+  }
+  song->timeline[i] = samples;
+  return song->timeline;
+}
+
+/**
+ * Streams only the samples from first up to last of a song or phrase.
+ * The frequency that sample first falls in is found by a binary search
+ * of the timeline, and the notes cut by either end of the range are
+ * synthesized in part, so the cost depends only on the length of the
+ * range.
+ */
+void streamRange(WaveStream* stream, Song* song, unsigned long long first, unsigned long long last)
+{
+  unsigned long long* timeline = songTimeline(song, stream->song);
+  unsigned long low = 0, high = song->num_frequencies, middle, i, index;
+  unsigned long long from, to, total, repeat, begin, end;
+  Frequency frequency;
+
+  while(high - low > 1) {
+    middle = low + (high - low) / 2;
+    if(timeline[middle] <= first)
+      low = middle;
+    else
+      high = middle;
+  }
+  for(i=low; i<song->num_frequencies && timeline[i] < last; i++) {
+    if(atomic_load_explicit(&stream->ring->error, memory_order_relaxed))
+      return;
+    if(timeline[i+1] <= first)
+      continue;
+    from = (first > timeline[i]) ? first - timeline[i] : 0;
+    to = ((last < timeline[i+1]) ? last : timeline[i+1]) - timeline[i];
+    frequency = song->frequencies[i];
+    if(from == 0 && to == timeline[i+1] - timeline[i])
+      streamFrequencies(stream, &song->frequencies[i], 1);
+    else if(FREQUENCY_IS_PHRASE(frequency)) {
+      index = PHRASE_INDEX(frequency);
+      total = stream->song->phrases[index].total_samples;
+      for(repeat = from / total; repeat * total < to; repeat++) {
+	begin = (from > repeat * total) ? from - repeat * total : 0;
+	end = (to < (repeat + 1) * total) ? to - repeat * total : total;
+	if(begin == 0 && end == total)
+	  streamPhrase(stream, index, 1);
+	else
+	  streamRange(stream, &stream->song->phrases[index], begin, end);
+      }
+    }
+    else if(FREQUENCY_PITCH(frequency) == PITCH_SILENCE)
+      streamBytes(stream, NULL, 2 * (to - from));
+    else if(!FREQUENCY_IS_TEMPO(frequency))
+      streamSound(stream, from, to - from, FREQUENCY_HERTZ(frequency));
+  }
+}
+
+/**
+ * Prints how often each side of a ring had to wait for the other.  A
+ * renderer that waits is held back by the output, and a writer that
+ * waits is held back by synthesis; only the first is helped by a
+ * deeper ring, and only if the output is uneven.
+ */
+void reportRing(Ring* ring, unsigned long blocks)
+{
+  logMessage("Ring: %lu blocks of %d bytes through a ring of %lu; at most %lu were waiting\n",
+	     blocks, RING_BLOCK_SIZE, ring->depth, ring->peak);
+  logMessage("  renderer waited for the writer %llu times, %.3f seconds\n",
+	     ring->renderer_waits, ring->renderer_wait_seconds);
+  logMessage("  writer waited for the renderer %llu times, %.3f seconds\n",
+	     ring->writer_waits, ring->writer_wait_seconds);
+}
+
+/**
+ * Renders a WAVE file to a stream such as STDOUT, which cannot be
+ * mapped.  The song is rendered in blocks that a writer thread writes
+ * out while the next ones are synthesized, through a ring of
+ * ring_depth blocks.  When the stream is a regular file written at its
+ * end, runs of at least WAVE_HOLE_SIZE zero bytes are seeked over
+ * rather than written, and are left as holes.  Returns 0 on success.
+ *
+ * first, last - the range of the song's samples to render; the whole
+ *               song is 0 to song->total_samples
+ */
+int writeWave(FILE* file, Song* song, unsigned long long first, unsigned long long last)
+{
+  Ring ring = {0};
+  WaveStream stream = {0};
+  pthread_t writer;
+  unsigned char header[RF64_HEADER_SIZE];
+  struct stat st;
+  int fd = fileno(file);
+  int flags = fcntl(fd, F_GETFL);
+  off_t offset;
+  unsigned long i;
+
+  /* The blocks are written straight to the file descriptor */
+  fflush(file);
+  offset = lseek(fd, 0, SEEK_CUR);
+
+  ring.depth = (ring_depth > 0) ? ring_depth : 1;
+  ring.blocks = (unsigned char*)mmap(NULL, (size_t)ring.depth * RING_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+				     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ring.lengths = (size_t*)malloc(sizeof(size_t) * ring.depth);
+  stream.rendered = (unsigned char**)calloc(song->num_phrases + 1, sizeof(unsigned char*));
+  stream.cached = (char*)calloc(song->num_phrases + 1, 1);
+  if(ring.blocks == MAP_FAILED || ring.lengths == NULL || stream.rendered == NULL || stream.cached == NULL) {
+    logMessage("ERROR: Could not allocate enough memory!\n");
+    exit(-3);
+  }
+  ring.fd = fd;
+  if(fstat(fd, &st) == 0) {
+    ring.sparse = S_ISREG(st.st_mode) && flags >= 0 && !(flags & O_APPEND) &&
+      offset >= 0 && offset >= st.st_size;
+    ring.splice = S_ISFIFO(st.st_mode);
+  }
+  pthread_mutex_init(&ring.lock, NULL);
+  pthread_cond_init(&ring.wake, NULL);
+  ring.threaded = (pthread_create(&writer, NULL, ringWriter, &ring) == 0);
+#ifdef F_SETPIPE_SZ
+  /* A pipe as large as a block takes each block in one vmsplice() */
+  if(ring.splice && fcntl(fd, F_GETPIPE_SZ) < RING_BLOCK_SIZE)
+    fcntl(fd, F_SETPIPE_SZ, RING_BLOCK_SIZE);
+#endif
+
+  stream.ring = &ring;
+  stream.song = song;
+  stream.silent = findSilentPhrases(song);
+  stream.cache_left = WAVE_CACHE_SIZE;
+  stream.block = nextRingBlock(&ring);
+
+  writeWaveHeader(header, last - first, SAMPLE_RATE);
+  streamBytes(&stream, header, waveHeaderSize(last - first));
+  if(first == 0 && last == song->total_samples)
+    streamFrequencies(&stream, song->frequencies, song->num_frequencies);
+  else if(first < last)
+    streamRange(&stream, song, first, last);
+  fillRingBlock(&ring, stream.length);
+
+  if(ring.threaded) {
+    pthread_mutex_lock(&ring.lock);
+    atomic_store(&ring.finished, 1);
+    pthread_cond_broadcast(&ring.wake);
+    pthread_mutex_unlock(&ring.lock);
+    pthread_join(writer, NULL);
+  }
+  if(ring.hole > 0 && !atomic_load(&ring.error)) {
+    flags = ring.hole >= WAVE_HOLE_SIZE;
+    writeRingHole(&ring);
+    if(flags && ((offset = lseek(fd, 0, SEEK_CUR)) < 0 || ftruncate(fd, offset) != 0))
+      atomic_store(&ring.error, 1);
+  }
+  if(ring_stats)
+    reportRing(&ring, (unsigned long)((waveHeaderSize(last - first) + 2 * (last - first) + RING_BLOCK_SIZE - 1) / RING_BLOCK_SIZE));
+
+  for(i=0; i<song->num_phrases; i++) {
+    if(stream.cached[i])
+      free(stream.rendered[i]);
+  }
+  free(stream.rendered);
+  free(stream.cached);
+  free(stream.silent);
+  /* Spliced pages still in the pipe stay valid once unmapped */
+  munmap(ring.blocks, (size_t)ring.depth * RING_BLOCK_SIZE);
+  free(ring.lengths);
+  pthread_mutex_destroy(&ring.lock);
+  pthread_cond_destroy(&ring.wake);
+  return atomic_load(&ring.error) ? -1 : 0;
+}
+
+/**
+ * Internal function to make room for needed elements of size bytes
+ * in an array whose allocated length is *capacity.
+ */
+static void* growCodeArray(void* array, unsigned long needed, unsigned long* capacity, size_t size)
+{
+  if(needed <= *capacity)
+    return array;
+  while(*capacity < needed)
+    *capacity = (*capacity < 16) ? 16 : 2 * *capacity;
+  array = realloc(array, size * *capacity);
+  if(array == NULL) {
+    logMessage("ERROR: Could not allocate enough memory!\n");
+    exit(-3);
+  }
+  return array;
+}
+
+/**
+ * Internal function to hash a key for a code table.
+ */
+static unsigned long codeTableSlot(CodeTable* table, unsigned long long key)
+{
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return (unsigned long)(key & (table->capacity - 1));
+}
+
+/**
+ * Internal function to find the value a code table maps a key to.
+ * Returns NULL if the key is not in the table; otherwise the value
+ * pointed to is the index + 1.
+ */
+static unsigned long* codeTableFind(CodeTable* table, unsigned long long key)
+{
+  unsigned long slot;
+
+  if(table->capacity == 0)
+    return NULL;
+  for(slot = codeTableSlot(table, key); table->values[slot] != 0; slot = (slot + 1) & (table->capacity - 1)) {
+    if(table->keys[slot] == key)
+      return &table->values[slot];
+  }
+  return NULL;
+}
+
+/**
+ * Internal function to add a key that is not yet in a code table.
+ */
+static void codeTableAdd(CodeTable* table, unsigned long long key, unsigned long value)
+{
+  unsigned long slot, i, old_capacity = table->capacity;
+  unsigned long long* old_keys = table->keys;
+  unsigned long* old_values = table->values;
+
+  if(2 * (table->size + 1) > table->capacity) {
+    table->capacity = (old_capacity < 64) ? 64 : 2 * old_capacity;
+    table->keys = (unsigned long long*)malloc(sizeof(unsigned long long) * table->capacity);
+    table->values = (unsigned long*)calloc(table->capacity, sizeof(unsigned long));
+    if(table->keys == NULL || table->values == NULL) {
+      logMessage("ERROR: Could not allocate enough memory!\n");
+      exit(-3);
+    }
+    table->size = 0;
+    for(i=0; i<old_capacity; i++) {
+      if(old_values[i] != 0)
+	codeTableAdd(table, old_keys[i], old_values[i] - 1);
+    }
+    free(old_keys);
+    free(old_values);
+  }
+  for(slot = codeTableSlot(table, key); table->values[slot] != 0; slot = (slot + 1) & (table->capacity - 1));
+  table->keys[slot] = key;
+  table->values[slot] = value + 1;
+  table->size++;
+}
+
+/**
+ * Returns non-zero if two code events are the same.
+ */
+static int sameCodeEvent(const CodeEvent* a, const CodeEvent* b)
+{
+  return a->symbol == b->symbol && a->count == b->count;
+}
+
+/**
+ * Internal function to hash a run of code events.
+ */
+static unsigned long long hashCodeEvents(const CodeEvent* events, unsigned long num_events)
+{
+  unsigned long long hash = 14695981039346656037ULL;
+  unsigned long i;
+
+  for(i=0; i<num_events; i++) {
+    hash = (hash ^ (unsigned long long)events[i].symbol) * 1099511628211ULL;
+    hash = (hash ^ (unsigned long long)events[i].count) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+/**
+ * Returns the index of a tone in the code for a song, adding it to
+ * the tone table if it is new.
+ */
+static long codeTone(SongCode* code, Frequency tone)
+{
+  unsigned long* index = codeTableFind(&code->tone_table, tone);
+
+  if(index != NULL)
+    return (long)(*index - 1);
+  code->tones = (Frequency*)growCodeArray(code->tones, code->num_tones + 1, &code->tone_capacity, sizeof(Frequency));
+  code->tones[code->num_tones] = tone;
+  codeTableAdd(&code->tone_table, tone, code->num_tones);
+  return (long)code->num_tones++;
+}
+
+/**
+ * Internal function to add a phrase, to be filled in later, to the
+ * code for a song.  Returns its index.
+ */
+static unsigned long addCodePhrase(SongCode* code)
+{
+  code->phrase_first = (unsigned long*)growCodeArray(code->phrase_first, code->num_phrases + 1, &code->phrase_capacity, sizeof(unsigned long));
+  code->phrase_last = (unsigned long*)realloc(code->phrase_last, sizeof(unsigned long) * code->phrase_capacity);
+  if(code->phrase_last == NULL) {
+    logMessage("ERROR: Could not allocate enough memory!\n");
+    exit(-3);
+  }
+  code->phrase_first[code->num_phrases] = 0;
+  code->phrase_last[code->num_phrases] = 0;
+  return code->num_phrases++;
+}
+
+static void compressCodeEvents(SongCode* code, const CodeEvent* events, unsigned long num_events,
+			       unsigned long* first, unsigned long* last);
+
+/**
+ * Returns the index of a phrase that plays a run of events once.
+ * Runs that were already made into a loop share its phrase.
+ */
+static long codeLoop(SongCode* code, const CodeEvent* events, unsigned long num_events)
+{
+  unsigned long long hash = hashCodeEvents(events, num_events);
+  unsigned long* found = codeTableFind(&code->loop_table, hash);
+  unsigned long i, loop, phrase, first, last;
+  CodeEvent* body;
+
+  if(found != NULL) {
+    loop = *found - 1;
+    for(i=0; i<num_events && code->loop_length[loop] == num_events &&
+	  sameCodeEvent(&code->loop_events[code->loop_offset[loop] + i], &events[i]); i++);
+    if(i == num_events && code->loop_length[loop] == num_events)
+      return (long)(code->num_phrases - code->num_loops + loop);
+  }
+
+  loop = code->num_loops;
+  code->loop_offset = (unsigned long*)growCodeArray(code->loop_offset, loop + 1, &code->loop_capacity, sizeof(unsigned long));
+  code->loop_length = (unsigned long*)realloc(code->loop_length, sizeof(unsigned long) * code->loop_capacity);
+  code->loop_events = (CodeEvent*)growCodeArray(code->loop_events, code->num_loop_events + num_events, &code->loop_event_capacity, sizeof(CodeEvent));
+  body = (CodeEvent*)malloc(sizeof(CodeEvent) * num_events);
+  if(code->loop_length == NULL || body == NULL) {
+    logMessage("ERROR: Could not allocate enough memory!\n");
+    exit(-3);
+  }
+  code->loop_offset[loop] = code->num_loop_events;
+  code->loop_length[loop] = num_events;
+  memcpy(code->loop_events + code->num_loop_events, events, sizeof(CodeEvent) * num_events);
+  code->num_loop_events += num_events;
+  code->num_loops++;
+  if(found == NULL)
+    codeTableAdd(&code->loop_table, hash, loop);
+
+  /* loops found in the body may move loop_events and the phrases */
+  phrase = addCodePhrase(code);
+  memcpy(body, events, sizeof(CodeEvent) * num_events);
+  compressCodeEvents(code, body, num_events, &first, &last);
+  code->phrase_first[phrase] = first;
+  code->phrase_last[phrase] = last;
+  free(body);
+  return (long)phrase;
+}
+
+/**
+ * Internal function to append an event to the words of the code for
+ * a song, splitting phrases played too many times for one call.
+ */
+static void appendCodeEvent(SongCode* code, const CodeEvent* event)
+{
+  unsigned long count;
+
+  if(event->symbol >= 0) {
+    code->words = (long*)growCodeArray(code->words, code->num_words + 1, &code->word_capacity, sizeof(long));
+    code->words[code->num_words++] = event->symbol;
+    return;
+  }
+  for(count = event->count; count > 0; count -= (count > MAX_CODE_COUNT) ? MAX_CODE_COUNT : count) {
+    code->words = (long*)growCodeArray(code->words, code->num_words + 2, &code->word_capacity, sizeof(long));
+    code->words[code->num_words++] = event->symbol;
+    code->words[code->num_words++] = (long)((count > MAX_CODE_COUNT) ? MAX_CODE_COUNT : count);
+  }
+}
+
+/**
+ * Internal function to find, for each event, the next event starting
+ * the same LOOP_WINDOW events, or 0 if there is none.
+ */
+static unsigned long* nextCodeWindows(const CodeEvent* events, unsigned long num_events)
+{
+  CodeTable windows;
+  unsigned long* next;
+  unsigned long* position;
+  unsigned long long hash;
+  unsigned long i;
+
+  next = (unsigned long*)calloc(num_events, sizeof(unsigned long));
+  if(next == NULL) {
+    logMessage("ERROR: Could not allocate enough memory!\n");
+    exit(-3);
+  }
+  memset(&windows, 0, sizeof(CodeTable));
+  for(i = num_events - LOOP_WINDOW + 1; i-- > 0; ) {
+    hash = hashCodeEvents(events + i, LOOP_WINDOW);
+    position = codeTableFind(&windows, hash);
+    if(position == NULL) {
+      codeTableAdd(&windows, hash, i);
+    }
+    else {
+      next[i] = *position - 1;
+      *position = i + 1;
+    }
+  }
+  free(windows.keys);
+  free(windows.values);
+  return next;
+}
+
+/**
+ * Appends events to the words of the code for a song, setting *first
+ * and *last to the range they occupy.  A run of events that is
+ * immediately repeated is replaced by a loop: a phrase holding the
+ * run, played as many times as the run repeats.  Every run of up to
+ * MAX_LOOP_LENGTH events is tried; a longer run is only tried if the
+ * events it starts with are played again right after it.
+ */
+static void compressCodeEvents(SongCode* code, const CodeEvent* events, unsigned long num_events,
+			       unsigned long* first, unsigned long* last)
+{
+  CodeEvent* output;
+  unsigned long* next = NULL;
+  unsigned long num_output = 0;
+  unsigned long i, length, run, repeats, best_length, best_repeats, best_saving;
+  unsigned long long_length = 0, long_run_end = 0;
+
+  output = (CodeEvent*)malloc(sizeof(CodeEvent) * (num_events + 1));
+  if(output == NULL) {
+    logMessage("ERROR: Could not allocate enough memory!\n");
+    exit(-3);
+  }
+  if(num_events > 2 * MAX_LOOP_LENGTH)
+    next = nextCodeWindows(events, num_events);
+
+  for(i=0; i<num_events; ) {
+    best_length = 0;
+    best_repeats = 1;
+    best_saving = 0;
+    for(length=1; length<=MAX_LOOP_LENGTH && i + 2 * length <= num_events; length++) {
+      for(run=0; i + length + run < num_events && sameCodeEvent(&events[i + run], &events[i + length + run]); run++);
+      repeats = 1 + run / length;
+      /* a loop costs a call and a phrase of its own */
+      if(repeats > 1 && length * (repeats - 1) > best_saving &&
+	 (length * (repeats - 1) > 2 || (length == 1 && events[i].symbol < 0))) {
+	best_length = length;
+	best_repeats = repeats;
+	best_saving = length * (repeats - 1);
+      }
+    }
+    if(next != NULL && next[i] > i + MAX_LOOP_LENGTH) {
+      /**
+       * The run at the next event with the same length is one shorter,
+       * so each run is only compared once.
+       */
+      length = next[i] - i;
+      if(length != long_length || i >= long_run_end) {
+	for(run=0; i + length + run < num_events && sameCodeEvent(&events[i + run], &events[i + length + run]); run++);
+	long_length = length;
+	long_run_end = i + run;
+      }
+      repeats = 1 + (long_run_end - i) / length;
+      if(repeats > 1 && length * (repeats - 1) > best_saving) {
+	best_length = length;
+	best_repeats = repeats;
+	best_saving = length * (repeats - 1);
+      }
+    }
+
+    if(best_length == 0) {
+      output[num_output++] = events[i++];
+      continue;
+    }
+    if(best_length == 1 && events[i].symbol < 0) {
+      /* the same phrase played several times in a row */
+      output[num_output] = events[i];
+      output[num_output++].count *= best_repeats;
+    }
+    else {
+      output[num_output].symbol = -1 - codeLoop(code, events + i, best_length);
+      output[num_output++].count = best_repeats;
+    }
+    i += best_length * best_repeats;
+  }
+
+  *first = code->num_words;
+  for(i=0; i<num_output; i++)
+    appendCodeEvent(code, &output[i]);
+  *last = code->num_words;
+  free(next);
+  free(output);
+}
+
+/**
+ * Internal function to convert frequencies to code events.  Returns
+ * the number of events, which is at most num_frequencies.
+ */
+static unsigned long codeEvents(SongCode* code, const Frequency* frequencies, unsigned long num_frequencies, CodeEvent* events)
+{
+  unsigned long i, num_events = 0;
+
+  for(i=0; i<num_frequencies; i++) {
+    if(FREQUENCY_IS_PHRASE(frequencies[i])) {
+      events[num_events].symbol = -1 - (long)PHRASE_INDEX(frequencies[i]);
+      events[num_events++].count = PHRASE_COUNT(frequencies[i]);
+    }
+    else if(!FREQUENCY_IS_TEMPO(frequencies[i]) && FREQUENCY_SAMPLES(frequencies[i]) > 0) {
+      events[num_events].symbol = codeTone(code, frequencies[i]);
+      events[num_events++].count = 1;
+    }
+  }
+  return num_events;
+}
+
+/**
+ * Generates the code for a song.  The code is as long as the song's
+ * distinct material rather than the song itself: tones are stored
+ * once, phrases played with X are stored once, and repeated runs of
+ * tones and phrases become loops.
+ */
+void songToCode(Song* song, SongCode* code)
+{
+  CodeEvent* events;
+  unsigned long i, num_events, first, last, longest = song->num_frequencies;
+
+  memset(code, 0, sizeof(SongCode));
+  for(i=0; i<song->num_phrases; i++) {
+    addCodePhrase(code);
+    if(song->phrases[i].num_frequencies > longest)
+      longest = song->phrases[i].num_frequencies;
+  }
+
+  events = (CodeEvent*)malloc(sizeof(CodeEvent) * (longest + 1));
+  if(events == NULL) {
+    logMessage("ERROR: Could not allocate enough memory!\n");
+    exit(-3);
+  }
+  for(i=0; i<song->num_phrases; i++) {
+    num_events = codeEvents(code, song->phrases[i].frequencies, song->phrases[i].num_frequencies, events);
+    compressCodeEvents(code, events, num_events, &first, &last);
+    code->phrase_first[i] = first;
+    code->phrase_last[i] = last;
+  }
+  num_events = codeEvents(code, song->frequencies, song->num_frequencies, events);
+  compressCodeEvents(code, events, num_events, &code->first, &code->last);
+  free(events);
+}
+
+void freeSongCode(SongCode* code)
+{
+  free(code->tones);
+  free(code->words);
+  free(code->phrase_first);
+  free(code->phrase_last);
+  free(code->tone_table.keys);
+  free(code->tone_table.values);
+  free(code->loop_table.keys);
+  free(code->loop_table.values);
+  free(code->loop_events);
+  free(code->loop_offset);
+  free(code->loop_length);
+}
+
+/**
+ * Internal function to write out what has been gathered in a buffer.
+ */
+static void flushCode(CodeBuffer* buffer)
+{
+  if(buffer->length > 0)
+    fwrite(buffer->data, 1, buffer->length, buffer->file);
+  buffer->length = 0;
+}
+
+/**
+ * Internal function to make room for size more bytes in a buffer.
+ */
+static inline void reserveCode(CodeBuffer* buffer, size_t size)
+{
+  if(buffer->length + size > CODE_BUFFER_SIZE)
+    flushCode(buffer);
+}
+
+/**
+ * Internal function to append a string to a buffer.
+ */
+static void putCode(CodeBuffer* buffer, const char* text)
+{
+  size_t length = strlen(text);
+
+  reserveCode(buffer, length);
+  if(length > CODE_BUFFER_SIZE) {
+    fwrite(text, 1, length, buffer->file);
+    return;
+  }
+  memcpy(buffer->data + buffer->length, text, length);
+  buffer->length += length;
+}
+
+/**
+ * Internal function to append formatted text to a buffer, for the
+ * lines that are only written once.
+ */
+static void printCode(CodeBuffer* buffer, const char* format, ...)
+{
+  va_list va_alist;
+  int length;
+
+  va_start(va_alist, format);
+  length = vsnprintf(buffer->data + buffer->length, CODE_BUFFER_SIZE - buffer->length, format, va_alist);
+  va_end(va_alist);
+  if(length >= 0 && (size_t)length >= CODE_BUFFER_SIZE - buffer->length) {
+    flushCode(buffer);
+    va_start(va_alist, format);
+    length = vsnprintf(buffer->data, CODE_BUFFER_SIZE, format, va_alist);
+    va_end(va_alist);
+    if(length >= CODE_BUFFER_SIZE) {
+      va_start(va_alist, format);
+      vfprintf(buffer->file, format, va_alist);
+      va_end(va_alist);
+      length = 0;
+    }
+  }
+  if(length > 0)
+    buffer->length += length;
+}
+
+/**
+ * Internal function to append a number to a buffer, as printf's "%ld"
+ * would.
+ */
+static void putCodeLong(CodeBuffer* buffer, long value)
+{
+  char digits[24];
+  int i = sizeof(digits);
+  unsigned long magnitude = (value < 0) ? 0UL - (unsigned long)value : (unsigned long)value;
+
+  do {
+    digits[--i] = '0' + (char)(magnitude % 10);
+    magnitude /= 10;
+  } while(magnitude > 0);
+  if(value < 0)
+    digits[--i] = '-';
+  reserveCode(buffer, sizeof(digits) - i);
+  memcpy(buffer->data + buffer->length, digits + i, sizeof(digits) - i);
+  buffer->length += sizeof(digits) - i;
+}
+
+/**
+ * Internal function to append a number to a buffer exactly as
+ * printf's "%.4f" would, without going through printf.  The double is
+ * split into its 53-bit mantissa and binary exponent, so that value *
+ * 10000 can be worked out exactly in 128-bit arithmetic and rounded
+ * half to even, as printf rounds.  Values too large for that, and
+ * infinities and NaNs, are left to printf.
+ */
+static void putCodeFixed(CodeBuffer* buffer, double value)
+{
+  unsigned __int128 scaled, half;
+  unsigned long long whole;
+  unsigned int fraction;
+  int exponent, shift;
+  double mantissa;
+
+  if(!isfinite(value) || fabs(value) >= 1e15) {
+    printCode(buffer, "%.4f", value);
+    return;
+  }
+  reserveCode(buffer, 24);
+  if(signbit(value))
+    buffer->data[buffer->length++] = '-';
+  mantissa = frexp(fabs(value), &exponent);
+  /* fabs(value) is mantissa * 2^exponent with 0.5 <= mantissa < 1 */
+  scaled = (unsigned __int128)(unsigned long long)ldexp(mantissa, 53) * 10000;
+  shift = 53 - exponent;
+  if(shift <= 0)
+    scaled <<= -shift;
+  else if(shift >= 127)
+    scaled = 0;
+  else {
+    half = (unsigned __int128)1 << (shift - 1);
+    if((scaled & ((half << 1) - 1)) > half ||
+       ((scaled & ((half << 1) - 1)) == half && ((scaled >> shift) & 1)))
+      scaled = (scaled >> shift) + 1;
+    else
+      scaled >>= shift;
+  }
+  whole = (unsigned long long)(scaled / 10000);
+  fraction = (unsigned int)(scaled % 10000);
+  putCodeLong(buffer, (long)whole);
+  reserveCode(buffer, 5);
+  buffer->data[buffer->length++] = '.';
+  buffer->data[buffer->length++] = '0' + fraction / 1000;
+  buffer->data[buffer->length++] = '0' + fraction / 100 % 10;
+  buffer->data[buffer->length++] = '0' + fraction / 10 % 10;
+  buffer->data[buffer->length++] = '0' + fraction % 10;
+}
+
+/**
+ * Internal function to separate the values of a generated C array,
+ * eight to a line.
+ */
+static void writeCodeSeparator(CodeBuffer* buffer, unsigned long i, unsigned long count)
+{
+  if(i + 1 == count)
+    putCode(buffer, "\n");
+  else if(i % 8 == 7)
+    putCode(buffer, ",\n\t");
+  else
+    putCode(buffer, ", ");
+}
+
+/**
+ * Writes a song as Interactive C code.  Its ints are 16 bits, so the
+ * tables are indexed and the words hold indices of at most
+ * MAX_IC_INDEX; a song with more distinct material is not written.
+ * Returns 0 on success.
+ */
+int writeIC(FILE* file, Song* song)
+{
+  SongCode code;
+  CodeBuffer buffer;
+  unsigned long i;
+
+  songToCode(song, &code);
+  if(code.num_words > MAX_IC_INDEX || code.num_tones > MAX_IC_INDEX || code.num_phrases > MAX_IC_INDEX) {
+    logMessage("Error: the song needs %lu words, %lu tones and %lu phrases, more than the %d Interactive C can index!\n",
+	       code.num_words, code.num_tones, code.num_phrases, MAX_IC_INDEX);
+    freeSongCode(&code);
+    return -1;
+  }
+  buffer.file = file;
+  buffer.length = 0;
+
+  printCode(&buffer, "/**\n * BASIC -> IC Play Statement Conversion\n * Using a Converter Written by Evan A. Sultanik\n * http://www.sultanik.com/\n */\n\n");
+
+  /* every list gets at least one value, since IC does not allow empty arrays */
+  printCode(&buffer, "/* tones: hertz and seconds, or 0 hertz and milliseconds for a rest */\n");
+  printCode(&buffer, "float tone_hertz[] = {\n\t");
+  for(i=0; i<code.num_tones; i++) {
+    putCodeFixed(&buffer, (FREQUENCY_HERTZ(code.tones[i]) <= 0) ? 0.0 : FREQUENCY_HERTZ(code.tones[i]));
+    writeCodeSeparator(&buffer, i, code.num_tones);
+  }
+  printCode(&buffer, "%s};\nfloat tone_seconds[] = {\n\t", (code.num_tones == 0) ? "0.0\n" : "");
+  for(i=0; i<code.num_tones; i++) {
+    putCodeFixed(&buffer, (FREQUENCY_HERTZ(code.tones[i]) <= 0) ? 0.0 : FREQUENCY_SECONDS(code.tones[i]));
+    writeCodeSeparator(&buffer, i, code.num_tones);
+  }
+  printCode(&buffer, "%s};\nlong tone_msecs[] = {\n\t", (code.num_tones == 0) ? "0.0\n" : "");
+  for(i=0; i<code.num_tones; i++) {
+    putCodeLong(&buffer, (FREQUENCY_HERTZ(code.tones[i]) <= 0) ? (long)(FREQUENCY_SECONDS(code.tones[i])*1000.0) : 0L);
+    putCode(&buffer, "L");
+    writeCodeSeparator(&buffer, i, code.num_tones);
+  }
+
+  printCode(&buffer, "%s};\n\n/* a tone, or -1 - a phrase followed by the times to play it */\n", (code.num_tones == 0) ? "0L\n" : "");
+  printCode(&buffer, "int words[] = {\n\t");
+  for(i=0; i<code.num_words; i++) {
+    putCodeLong(&buffer, code.words[i]);
+    writeCodeSeparator(&buffer, i, code.num_words);
+  }
+  printCode(&buffer, "%s};\n\n/* the words each phrase plays */\n", (code.num_words == 0) ? "0\n" : "");
+  printCode(&buffer, "int phrase_first[] = {\n\t");
+  for(i=0; i<code.num_phrases; i++) {
+    putCodeLong(&buffer, (long)code.phrase_first[i]);
+    writeCodeSeparator(&buffer, i, code.num_phrases);
+  }
+  printCode(&buffer, "%s};\nint phrase_last[] = {\n\t", (code.num_phrases == 0) ? "0\n" : "");
+  for(i=0; i<code.num_phrases; i++) {
+    putCodeLong(&buffer, (long)code.phrase_last[i]);
+    writeCodeSeparator(&buffer, i, code.num_phrases);
+  }
+  printCode(&buffer, "%s};\n\n", (code.num_phrases == 0) ? "0\n" : "");
+
+  printCode(&buffer, "void play(int first, int last)\n{\n");
+  printCode(&buffer, "\tint i, phrase, count;\n\n");
+  printCode(&buffer, "\tfor(i = first; i < last; i++) {\n");
+  printCode(&buffer, "\t\tif(words[i] < 0) {\n");
+  printCode(&buffer, "\t\t\tphrase = -1 - words[i];\n");
+  printCode(&buffer, "\t\t\tfor(count = words[++i]; count > 0; count--)\n");
+  printCode(&buffer, "\t\t\t\tplay(phrase_first[phrase], phrase_last[phrase]);\n");
+  printCode(&buffer, "\t\t}\n");
+  printCode(&buffer, "\t\telse if(tone_hertz[words[i]] > 0.0)\n");
+  printCode(&buffer, "\t\t\ttone(tone_hertz[words[i]], tone_seconds[words[i]]);\n");
+  printCode(&buffer, "\t\telse\n");
+  printCode(&buffer, "\t\t\tmsleep(tone_msecs[words[i]]);\n");
+  printCode(&buffer, "\t}\n}\n\n");
+
+  printCode(&buffer, "int main()\n{\n");
+  printCode(&buffer, "\tplay(%lu, %lu);\n", code.first, code.last);
+  printCode(&buffer, "\treturn 1;\n}\n");
+
+  flushCode(&buffer);
+  freeSongCode(&code);
+  return 0;
+}
+
+/**
+ * Internal function to write a generated list as DATA statements.
+ */
+static void writeBASData(CodeBuffer* buffer, long* values, unsigned long count)
+{
+  unsigned long i;
+
+  for(i=0; i<count; i++) {
+    if(i % 8 == 0)
+      putCode(buffer, "DATA ");
+    putCodeLong(buffer, values[i]);
+    putCode(buffer, (i % 8 == 7 || i + 1 == count) ? "\n" : ", ");
+  }
+}
+
+void writeBAS(FILE* file, Song* song)
+{
+  SongCode code;
+  CodeBuffer buffer;
+  unsigned long i;
+  long range[2];
+
+  songToCode(song, &code);
+  buffer.file = file;
+  buffer.length = 0;
+
+  printCode(&buffer, "REM PLAY -> SOUND Statement Conversion\nREM Using a Converter Written by Evan A. Sultanik\nREM http://www.sultanik.com/\n\n");
+
+  printCode(&buffer, "DECLARE SUB PlayWords (First&, Last&)\n");
+  printCode(&buffer, "DIM SHARED ToneHertz%%(%lu), ToneLength!(%lu)\n", code.num_tones, code.num_tones);
+  printCode(&buffer, "DIM SHARED Words&(%lu)\n", code.num_words);
+  printCode(&buffer, "DIM SHARED PhraseFirst&(%lu), PhraseLast&(%lu)\n", code.num_phrases, code.num_phrases);
+  printCode(&buffer, "FOR I& = 0 TO %ld: READ ToneHertz%%(I&), ToneLength!(I&): NEXT\n", (long)code.num_tones - 1);
+  printCode(&buffer, "FOR I& = 0 TO %ld: READ Words&(I&): NEXT\n", (long)code.num_words - 1);
+  printCode(&buffer, "FOR I& = 0 TO %ld: READ PhraseFirst&(I&), PhraseLast&(I&): NEXT\n", (long)code.num_phrases - 1);
+  printCode(&buffer, "PlayWords %lu, %lu\n", code.first, code.last);
+  printCode(&buffer, "END\n\n");
+
+  printCode(&buffer, "REM tones: hertz and clock ticks, or 0 hertz and seconds for a rest\n");
+  for(i=0; i<code.num_tones; i++) {
+    putCode(&buffer, "DATA ");
+    if(FREQUENCY_HERTZ(code.tones[i]) < SOUND_HERTZ_LOWEST || FREQUENCY_HERTZ(code.tones[i]) > SOUND_HERTZ_HIGHEST) {
+      putCode(&buffer, "0, ");
+      putCodeFixed(&buffer, FREQUENCY_SECONDS(code.tones[i]));
+    }
+    else {
+      putCodeLong(&buffer, (int)FREQUENCY_HERTZ(code.tones[i]));
+      putCode(&buffer, ", ");
+      putCodeFixed(&buffer, SOUND_DURATION(FREQUENCY_SECONDS(code.tones[i])));
+    }
+    putCode(&buffer, "\n");
+  }
+  printCode(&buffer, "REM a tone, or -1 - a phrase followed by the times to play it\n");
+  writeBASData(&buffer, code.words, code.num_words);
+  printCode(&buffer, "REM the words each phrase plays\n");
+  for(i=0; i<code.num_phrases; i++) {
+    range[0] = (long)code.phrase_first[i];
+    range[1] = (long)code.phrase_last[i];
+    writeBASData(&buffer, range, 2);
+  }
+
+  printCode(&buffer, "\nSUB PlayWords (First&, Last&)\n");
+  printCode(&buffer, "  I& = First&\n");
+  printCode(&buffer, "  DO WHILE I& < Last&\n");
+  printCode(&buffer, "    T& = Words&(I&)\n");
+  printCode(&buffer, "    IF T& < 0 THEN\n");
+  printCode(&buffer, "      P& = -1 - T&\n");
+  printCode(&buffer, "      I& = I& + 1\n");
+  printCode(&buffer, "      FOR Count& = 1 TO Words&(I&)\n");
+  printCode(&buffer, "        PlayWords PhraseFirst&(P&), PhraseLast&(P&)\n");
+  printCode(&buffer, "      NEXT\n");
+  printCode(&buffer, "    ELSEIF ToneHertz%%(T&) = 0 THEN\n");
+  printCode(&buffer, "      Seconds = TIMER + ToneLength!(T&)\n");
+  printCode(&buffer, "      DO\n");
+  printCode(&buffer, "      LOOP WHILE TIMER <= Seconds\n");
+  printCode(&buffer, "    ELSE\n");
+  printCode(&buffer, "      SOUND ToneHertz%%(T&), ToneLength!(T&)\n");
+  printCode(&buffer, "    END IF\n");
+  printCode(&buffer, "    I& = I& + 1\n");
+  printCode(&buffer, "  LOOP\n");
+  printCode(&buffer, "END SUB\n");
+
+  flushCode(&buffer);
+  freeSongCode(&code);
+}
+
+/**
+ * Internal function to append bytes to a MIDI track.
+ */
+static void putMidiBytes(MidiTrack* track, const unsigned char* bytes, size_t size)
+{
+  unsigned char* data;
+
+  if(track->length + size > track->capacity) {
+    track->capacity = (track->capacity < 4096) ? 4096 : 2 * track->capacity;
+    if(track->capacity < track->length + size)
+      track->capacity = track->length + size;
+    data = (unsigned char*)realloc(track->data, track->capacity);
+    if(data == NULL) {
+      logMessage("ERROR: Could not allocate enough memory!\n");
+      exit(-3);
+    }
+    track->data = data;
+  }
+  memcpy(track->data + track->length, bytes, size);
+  track->length += size;
+}
+
+/**
+ * Internal function to append an event to a MIDI track, at the time
+ * of the samples played so far.  A quarter note (L4) is rendered for
+ * 15 / T seconds, so that is how long MIDI_DIVISION ticks last.
+ */
+static void putMidiEvent(MidiTrack* track, const unsigned char* event, size_t size)
+{
+  unsigned long long tick, delta;
+  unsigned char bytes[10];
+  int i = sizeof(bytes);
+
+  tick = track->tempo_tick + ((track->samples - track->tempo_samples) * track->l4_per_minute * MIDI_DIVISION +
+			      15ULL * SAMPLE_RATE / 2) / (15ULL * SAMPLE_RATE);
+  delta = tick - track->tick;
+  track->tick = tick;
+
+  /* the delta time is a variable length quantity, seven bits a byte */
+  bytes[--i] = delta & 0x7f;
+  for(delta >>= 7; delta > 0; delta >>= 7)
+    bytes[--i] = 0x80 | (delta & 0x7f);
+  putMidiBytes(track, bytes + i, sizeof(bytes) - i);
+  putMidiBytes(track, event, size);
+}
+
+/**
+ * Internal function to append a Set Tempo event to a MIDI track.
+ */
+static void putMidiTempo(MidiTrack* track, unsigned long l4_per_minute)
+{
+  unsigned long microseconds = (15000000UL + l4_per_minute / 2) / l4_per_minute;
+  unsigned char event[6];
+
+  event[0] = 0xff;
+  event[1] = 0x51;
+  event[2] = 3;
+  event[3] = (microseconds >> 16) & 0xff;
+  event[4] = (microseconds >> 8) & 0xff;
+  event[5] = microseconds & 0xff;
+  putMidiEvent(track, event, sizeof(event));
+  track->tempo_samples = track->samples;
+  track->tempo_tick = track->tick;
+  track->l4_per_minute = l4_per_minute;
+}
+
+/**
+ * Internal function to append frequencies to a MIDI track, playing
+ * each reference to a phrase as many times as it says.
+ */
+static void writeMidiFrequencies(MidiTrack* track, const Frequency* frequencies, unsigned long num_frequencies, Song* song)
+{
+  unsigned long i, count, index;
+  unsigned char event[3];
+
+  for(i=0; i<num_frequencies; i++) {
+    if(FREQUENCY_IS_PHRASE(frequencies[i])) {
+      index = PHRASE_INDEX(frequencies[i]);
+      for(count = PHRASE_COUNT(frequencies[i]); count > 0; count--)
+	writeMidiFrequencies(track, song->phrases[index].frequencies, song->phrases[index].num_frequencies, song);
+    }
+    else if(FREQUENCY_IS_TEMPO(frequencies[i])) {
+      putMidiTempo(track, TEMPO_L4_PER_MINUTE(frequencies[i]));
+    }
+    else if(FREQUENCY_PITCH(frequencies[i]) == PITCH_SILENCE || FREQUENCY_SAMPLES(frequencies[i]) == 0) {
+      track->samples += FREQUENCY_SAMPLES(frequencies[i]);
+    }
+    else {
+      event[0] = 0x90;
+      event[1] = MIDI_NOTE(FREQUENCY_PITCH(frequencies[i]));
+      event[2] = MIDI_VELOCITY;
+      putMidiEvent(track, event, sizeof(event));
+      track->samples += FREQUENCY_SAMPLES(frequencies[i]);
+      event[0] = 0x80;
+      event[2] = 0;
+      putMidiEvent(track, event, sizeof(event));
+    }
+  }
+}
+
+/**
+ * Writes a song as a Type 0 Standard MIDI File: a single track on
+ * channel 1, with a Set Tempo event for every T.  The track is built
+ * in memory, since its length comes before it in the file.  Returns
+ * 0 on success.
+ */
+int writeMidi(FILE* file, Song* song)
+{
+  MidiTrack track;
+  unsigned char header[22] = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1,
+			       MIDI_DIVISION >> 8, MIDI_DIVISION & 0xff, 'M', 'T', 'r', 'k' };
+  const unsigned char end_of_track[3] = { 0xff, 0x2f, 0 };
+  int result = 0;
+
+  memset(&track, 0, sizeof(MidiTrack));
+  putMidiTempo(&track, 120);
+  writeMidiFrequencies(&track, song->frequencies, song->num_frequencies, song);
+  putMidiEvent(&track, end_of_track, sizeof(end_of_track));
+
+  if(track.length > 0xffffffffUL) {
+    logMessage("Error: the song is too long for a MIDI file!\n");
+    free(track.data);
+    return -1;
+  }
+  header[18] = (track.length >> 24) & 0xff;
+  header[19] = (track.length >> 16) & 0xff;
+  header[20] = (track.length >> 8) & 0xff;
+  header[21] = track.length & 0xff;
+  if(fwrite(header, 1, sizeof(header), file) != sizeof(header) ||
+     fwrite(track.data, 1, track.length, file) != track.length)
+    result = -1;
+  free(track.data);
+  return result;
+}
+
+/**
+ * Internal function to load a little-endian 32-bit value.
+ */
+static unsigned long getLE32(const unsigned char* bytes)
+{
+  return (unsigned long)bytes[0] | ((unsigned long)bytes[1] << 8) |
+    ((unsigned long)bytes[2] << 16) | ((unsigned long)bytes[3] << 24);
+}
+
+/**
+ * Internal function to load a little-endian 64-bit value.
+ */
+static unsigned long long getLE64(const unsigned char* bytes)
+{
+  unsigned long long value = 0;
+  int i;
+  for(i=7; i>=0; i--)
+    value = (value << 8) | bytes[i];
+  return value;
+}
+
+/**
+ * Returns non-zero if frequencies are stored in memory in the same
+ * byte order as in a compiled song.
+ */
+static int nativeSongOrder()
+{
+  Frequency probe = 1;
+  return *(unsigned char*)&probe == 1;
+}
+
+/**
+ * Adds words to the checksum of a compiled song.
+ */
+static unsigned long long checksumWords(unsigned long long checksum, const Frequency* words, unsigned long num_words)
+{
+  unsigned long i;
+
+  for(i=0; i<num_words; i++)
+    checksum = (checksum ^ words[i]) * 1099511628211ULL; /* FNV-1a prime */
+  return checksum;
+}
+
+/**
+ * Returns the checksum of a compiled song, given its header and the
+ * words following it (in native byte order).
+ */
+unsigned long long songChecksum(const unsigned char* header, const Frequency* words, unsigned long num_words)
+{
+  unsigned long long checksum = 14695981039346656037ULL; /* FNV-1a offset basis */
+  unsigned long i;
+
+  for(i=SONG_MAGIC_SIZE; i<SONG_CHECKSUM_OFFSET; i++)
+    checksum = (checksum ^ header[i]) * 1099511628211ULL;
+  return checksumWords(checksum, words, num_words);
+}
+
+/**
+ * Writes the header of a compiled song to the SONG_HEADER_SIZE bytes
+ * at header.  A compiled song is laid out as follows, with all numbers
+ * little-endian:
+ *
+ * offset  size
+ *      0     8  SONG_MAGIC
+ *      8     4  SONG_VERSION
+ *     12     4  sample rate
+ *     16     8  number of frequencies, n
+ *     24     8  total number of samples
+ *     32     8  number of phrases, p
+ *     40     8  checksum of bytes 8--39 and everything after the header
+ *     48   8*n  the frequencies, each packed as in memory
+ *          8*p  the number of frequencies of each phrase
+ *          8*p  the total number of samples of each phrase
+ *               the frequencies of each phrase, one phrase after the other
+ */
+void writeSongHeader(unsigned char* header, Song* song)
+{
+  memcpy(header, SONG_MAGIC, SONG_MAGIC_SIZE);
+  putLE32(header + 8, SONG_VERSION);
+  putLE32(header + 12, SAMPLE_RATE);
+  putLE64(header + 16, song->num_frequencies);
+  putLE64(header + 24, song->total_samples);
+  putLE64(header + 32, song->num_phrases);
+}
+
+/**
+ * Internal function to write words to a compiled song, converting
+ * them to little-endian if need be.  Returns 0 on success.
+ */
+static int writeSongWords(FILE* file, const Frequency* words, unsigned long num_words)
+{
+  unsigned char buffer[SONG_FREQUENCY_SIZE * 512];
+  unsigned long i, j;
+
+  if(nativeSongOrder())
+    return (fwrite(words, SONG_FREQUENCY_SIZE, num_words, file) == num_words) ? 0 : -1;
+
+  for(i=0; i<num_words; i+=512) {
+    for(j=0; j<512 && i+j<num_words; j++)
+      putLE64(buffer + j * SONG_FREQUENCY_SIZE, words[i+j]);
+    if(fwrite(buffer, SONG_FREQUENCY_SIZE, j, file) != j)
+      return -1;
+  }
+  return 0;
+}
+
+/**
+ * Writes a song in compiled form.  Returns 0 on success.
+ */
+int writeSong(FILE* file, Song* song)
+{
+  unsigned char header[SONG_HEADER_SIZE];
+  Frequency* table = (Frequency*)malloc(sizeof(Frequency) * (2 * song->num_phrases + 1));
+  unsigned long long checksum;
+  unsigned long i;
+  int result = 0;
+
+  if(table == NULL) {
+    logMessage("ERROR: Could not allocate enough memory!\n");
+    return -1;
+  }
+  for(i=0; i<song->num_phrases; i++) {
+    table[i] = song->phrases[i].num_frequencies;
+    table[song->num_phrases + i] = song->phrases[i].total_samples;
+  }
+
+  writeSongHeader(header, song);
+  checksum = songChecksum(header, song->frequencies, song->num_frequencies);
+  checksum = checksumWords(checksum, table, 2 * song->num_phrases);
+  for(i=0; i<song->num_phrases; i++)
+    checksum = checksumWords(checksum, song->phrases[i].frequencies, song->phrases[i].num_frequencies);
+  putLE64(header + SONG_CHECKSUM_OFFSET, checksum);
+
+  if(fwrite(header, 1, SONG_HEADER_SIZE, file) != SONG_HEADER_SIZE ||
+     writeSongWords(file, song->frequencies, song->num_frequencies) != 0 ||
+     writeSongWords(file, table, 2 * song->num_phrases) != 0)
+    result = -1;
+  for(i=0; i<song->num_phrases && result == 0; i++)
+    result = writeSongWords(file, song->phrases[i].frequencies, song->phrases[i].num_frequencies);
+
+  free(table);
+  return result;
+}
+
+/**
+ * Internal function to check that every frequency has a known pitch,
+ * that every phrase referred to by frequencies is one of the first
+ * num_phrases phrases of song, and that the frequencies play for
+ * exactly total_samples samples.  Those phrases must already have
+ * been checked, so that their own totals can be trusted.
+ */
+static int validFrequencies(const Frequency* frequencies, unsigned long num_frequencies, Song* song, unsigned long num_phrases,
+			    unsigned long long total_samples)
+{
+  unsigned long long samples = 0;
+  unsigned long i;
+
+  for(i=0; i<num_frequencies; i++) {
+    if(FREQUENCY_IS_PHRASE(frequencies[i])) {
+      if(PHRASE_INDEX(frequencies[i]) >= num_phrases)
+	return 0;
+      samples = saturatingAdd(samples, saturatingMultiply(PHRASE_COUNT(frequencies[i]),
+							  song->phrases[PHRASE_INDEX(frequencies[i])].total_samples));
+    }
+    else if(!FREQUENCY_IS_TEMPO(frequencies[i])) {
+      if(FREQUENCY_PITCH(frequencies[i]) >= NUM_PITCHES)
+	return 0;
+      samples = saturatingAdd(samples, FREQUENCY_SAMPLES(frequencies[i]));
+    }
+  }
+  return samples == total_samples && samples <= MAX_SONG_SAMPLES;
+}
+
+/**
+ * Loads a compiled song by mapping it into memory; no parsing is
+ * needed, and on little-endian machines the frequencies are used
+ * straight from the mapping.  Returns 1 if the file is a compiled
+ * song, 0 if it is not (and so should be parsed as a PLAY statement),
+ * or -1 if it is a compiled song that cannot be used.
+ */
+int loadSong(char* filename, Song* song)
+{
+  int fd = open(filename, O_RDONLY);
+  struct stat status;
+  unsigned char* mapping;
+  Frequency* words;
+  Frequency* phrase_frequencies;
+  unsigned long long num_frequencies, num_phrases, num_words, i;
+  int valid;
+
+  if(fd < 0) {
+    logMessage("Error: could not open %s for reading!\n", filename);
+    return -1;
+  }
+  if(fstat(fd, &status) != 0 || status.st_size < SONG_HEADER_SIZE) {
+    close(fd);
+    return 0;
+  }
+  mapping = (unsigned char*)mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(mapping == MAP_FAILED) {
+    logMessage("Error: could not map %s: %s\n", filename, strerror(errno));
+    return -1;
+  }
+  if(memcmp(mapping, SONG_MAGIC, SONG_MAGIC_SIZE) != 0) {
+    munmap(mapping, status.st_size);
+    return 0;
+  }
+  if(getLE32(mapping + 8) != SONG_VERSION || getLE32(mapping + 12) != SAMPLE_RATE) {
+    logMessage("Error: %s was compiled by an incompatible version of BasicPlay!\n", filename);
+    munmap(mapping, status.st_size);
+    return -1;
+  }
+
+  memset(song, 0, sizeof(Song));
+  num_frequencies = getLE64(mapping + 16);
+  num_phrases = getLE64(mapping + 32);
+  num_words = (status.st_size - SONG_HEADER_SIZE) / SONG_FREQUENCY_SIZE;
+  words = (Frequency*)(mapping + SONG_HEADER_SIZE);
+  if(!nativeSongOrder()) {
+    words = (Frequency*)malloc(sizeof(Frequency) * (num_words + 1));
+    if(words == NULL) {
+      logMessage("ERROR: Could not allocate enough memory!\n");
+      munmap(mapping, status.st_size);
+      return -1;
+    }
+    for(i=0; i<num_words; i++)
+      words[i] = getLE64(mapping + SONG_HEADER_SIZE + i * SONG_FREQUENCY_SIZE);
+    song->capacity = num_words;
+  }
+  else {
+    song->mapping = mapping;
+    song->mapping_size = status.st_size;
+  }
+  song->frequencies = words;
+  song->num_frequencies = num_frequencies;
+  song->total_samples = getLE64(mapping + 24);
+
+  valid = (status.st_size - SONG_HEADER_SIZE) % SONG_FREQUENCY_SIZE == 0 &&
+    num_phrases <= MAX_PHRASES && num_frequencies <= num_words && 2 * num_phrases <= num_words - num_frequencies &&
+    getLE64(mapping + SONG_CHECKSUM_OFFSET) == songChecksum(mapping, words, num_words);
+  if(valid && num_phrases > 0) {
+    song->phrases = (Song*)calloc(num_phrases, sizeof(Song));
+    valid = song->phrases != NULL;
+  }
+  phrase_frequencies = words + num_frequencies + 2 * num_phrases;
+  for(i=0; valid && i<num_phrases; i++) {
+    song->phrases[i].frequencies = phrase_frequencies;
+    song->phrases[i].num_frequencies = words[num_frequencies + i];
+    song->phrases[i].total_samples = words[num_frequencies + num_phrases + i];
+    song->num_phrases++;
+    /* a phrase may only refer to the phrases before it, so none can play itself */
+    valid = song->phrases[i].num_frequencies <= (unsigned long long)(words + num_words - phrase_frequencies) &&
+      validFrequencies(song->phrases[i].frequencies, song->phrases[i].num_frequencies, song, i, song->phrases[i].total_samples);
+    if(valid)
+      phrase_frequencies += song->phrases[i].num_frequencies;
+  }
+  valid = valid && phrase_frequencies == words + num_words &&
+    validFrequencies(song->frequencies, song->num_frequencies, song, num_phrases, song->total_samples);
+  if(!valid) {
+    logMessage("Error: %s is corrupt; please compile it again!\n", filename);
+    freeSong(song);
+    if(!nativeSongOrder())
+      munmap(mapping, status.st_size);
+    return -1;
+  }
+  if(!nativeSongOrder())
+    munmap(mapping, status.st_size);
+  return 1;
+}
+
+char* getFileSuffix(char* string)
+{
+  int i, last_period = -1;
+  if(string == NULL)
+    return NULL;
+  for(i=0; string[i] != '\0'; i++) {
+    if(string[i] == '.')
+      last_period = i;
+  }
+  if(last_period < 0 || last_period >= i - 1)
+    return NULL;
+  return string + last_period + 1;
+}
+
+void readFile(FILE* file, char** string)
+{
+  char* temp;
+  size_t num_read;
+  size_t length = 0;
+  size_t capacity = 4096;
+
+  *string = (char*)malloc(sizeof(char) * capacity);
+
+  while(*string != NULL && (num_read = fread(*string + length, sizeof(char), capacity - length - 1, file))) {
+    length += num_read;
+    if(capacity - length - 1 == 0) {
+      capacity *= 2;
+      temp = (char*)realloc(*string, sizeof(char) * capacity);
+      if(temp == NULL)
+	free(*string);
+      *string = temp;
+    }
+  }
+  if(*string != NULL)
+    (*string)[length] = '\0';
+}
+
+/**
+ * Reads a song from a file, which may hold a compiled BasicPlay song
+ * or a PLAY statement, or from the PLAY statement play if it is not
+ * NULL.  Syntax errors and warnings are reported before it returns.
+ * Returns 0 on success, or the exit status to fail with.
+ */
+int readSong(char* filename, char* play, unsigned int num_threads, Song* song)
+{
+  FILE* file;
+  char* input_string = play;
+  unsigned long num_notes;
+  unsigned int i;
+  int result;
+
+  if(play == NULL) {
+    result = loadSong(filename, song);
+    if(result < 0)
+      return -2;
+    if(result > 0)
+      return 0;
+    file = fopen(filename, "rb");
+    if(file == NULL) {
+      logMessage("Error: could not open %s for reading!\n", filename);
+      return -2;
+    }
+    readFile(file, &input_string);
+    fclose(file);
+    if(input_string == NULL) {
+      logMessage("ERROR: Could not allocate enough memory!\n");
+      return -3;
+    }
+  }
+
+  for(i=0; i<num_substrings; i++)
+    parseSubstring(i);
+
+  parseToFrequency(input_string, strlen(input_string), num_threads, song, &num_notes);
+  reportDiagnostics(&all_diagnostics);
+  if(input_string != play)
+    free(input_string);
+  return 0;
+}
+
+/**
+ * Internal function to append frequencies to a song, adding offset to
+ * the index of every phrase they refer to.
+ */
+static void appendRenumbered(Song* song, const Frequency* frequencies, unsigned long num_frequencies, unsigned long offset)
+{
+  unsigned long i;
+
+  for(i=0; i<num_frequencies; i++) {
+    if(FREQUENCY_IS_PHRASE(frequencies[i]))
+      appendFrequency(PHRASE_REFERENCE(PHRASE_INDEX(frequencies[i]) + offset, PHRASE_COUNT(frequencies[i])), song);
+    else
+      appendFrequency(frequencies[i], song);
+  }
+}
+
+/**
+ * Plays part after the end of song, then frees part.  Its phrases are
+ * copied after song's own and renumbered to match.  Returns 0 on
+ * success, or -1 if song would have too many phrases.
+ */
+int appendSong(Song* song, Song* part)
+{
+  unsigned long offset = song->num_phrases;
+  unsigned long i;
+  Song* phrases;
+  Song* phrase;
+
+  if(offset + part->num_phrases > MAX_PHRASES) {
+    logMessage("Error: the songs play more than %lu different phrases!\n", (unsigned long)MAX_PHRASES);
+    freeSong(part);
+    return -1;
+  }
+  if(song->total_samples + part->total_samples > MAX_SONG_SAMPLES) {
+    logMessage("Error: the songs play for too long to be joined!\n");
+    freeSong(part);
+    return -1;
+  }
+  if(offset + part->num_phrases > song->phrase_capacity) {
+    song->phrase_capacity = (song->phrase_capacity < 16) ? 16 : 2 * song->phrase_capacity;
+    if(song->phrase_capacity < offset + part->num_phrases)
+      song->phrase_capacity = offset + part->num_phrases;
+    phrases = (Song*)realloc(song->phrases, sizeof(Song) * song->phrase_capacity);
+    if(phrases == NULL) {
+      logMessage("ERROR: Could not allocate enough memory!\n");
+      exit(-3);
+    }
+    song->phrases = phrases;
+  }
+  for(i=0; i<part->num_phrases; i++) {
+    phrase = &song->phrases[song->num_phrases++];
+    memset(phrase, 0, sizeof(Song));
+    phrase->substring = part->phrases[i].substring;
+    phrase->start = part->phrases[i].start;
+    phrase->end = part->phrases[i].end;
+    phrase->total_samples = part->phrases[i].total_samples;
+    appendRenumbered(phrase, part->phrases[i].frequencies, part->phrases[i].num_frequencies, offset);
+  }
+  appendRenumbered(song, part->frequencies, part->num_frequencies, offset);
+  song->total_samples += part->total_samples;
+  free(song->timeline);
+  song->timeline = NULL;
+  freeSong(part);
+  return 0;
+}
+
+/**
+ * Reads every song named in a playlist, one file to a line, and joins
+ * them into one song with gap seconds of silence between each.  Blank
+ * lines and lines starting with '#' are skipped, and relative file
+ * names are taken from the playlist's directory.  Every song is
+ * parsed from the default music state and tempo, so nothing but the
+ * sub-strings defined with -x carries over from one song to the next.
+ * The songs are not streamed: all of them are converted before any
+ * output is written, so the joined song grows with the playlist.
+ * Returns 0 on success, or the exit status to fail with.
+ */
+int readPlaylist(char* playlist, double gap, unsigned int num_threads, Song* song)
+{
+  FILE* file = fopen(playlist, "rb");
+  char* list = NULL;
+  char* line;
+  char* end;
+  char* path;
+  char* slash;
+  size_t directory_length = 0, length;
+  unsigned long num_songs = 0;
+  MusicState initial;
+  Song part;
+  int result = 0;
+
+  if(file == NULL) {
+    logMessage("Error: could not open %s for reading!\n", playlist);
+    return -2;
+  }
+  readFile(file, &list);
+  fclose(file);
+  if(list == NULL) {
+    logMessage("ERROR: Could not allocate enough memory!\n");
+    return -3;
+  }
+  if((slash = strrchr(playlist, '/')) != NULL)
+    directory_length = slash - playlist + 1;
+  initMusicState(&initial);
 
-      if(code & CODE_NOTE) {
-	/**
-	 * This note has a duration in and of itself.
-	 */
-	addNote(CODE_DURATION, value, &current_note, &last_note);
-	addNote(code, lastvalue, &current_note, &last_note);
-	addNote(CODE_DURATION, last_duration, &current_note, &last_note);
-      }
-      else {
-	addNote(code, value, &current_note, &last_note);
-      }
-      code_set = 0;
-      number_sequence_length = 0;
-    }
-    else if(curr_char == ' ') {
+  for(line = list; *line != '\0' && result == 0; line = end) {
+    end = line + strcspn(line, "\n");
+    if(*end != '\0')
+      *end++ = '\0';
+    while(isspace((unsigned char)*line))
+      line++;
+    for(length = strlen(line); length > 0 && isspace((unsigned char)line[length - 1]); length--)
+      line[length - 1] = '\0';
+    if(*line == '\0' || *line == '#')
+      continue;
 
+    path = (char*)malloc(directory_length + length + 1);
+    if(path == NULL) {
+      logMessage("ERROR: Could not allocate enough memory!\n");
+      exit(-3);
     }
+    if(*line == '/')
+      strcpy(path, line);
     else {
-      syntaxError("Symbol not expected:", play, play_length, i);
+      memcpy(path, playlist, directory_length);
+      strcpy(path + directory_length, line);
     }
+    memset(&part, 0, sizeof(Song));
+    result = readSong(path, NULL, num_threads, &part);
+    free(path);
+    if(result != 0)
+      break;
+
+    if(num_songs++ > 0) {
+      if(gap > 0.0)
+	addFrequency(PITCH_SILENCE, (unsigned long long)llround(gap * SAMPLE_RATE), song);
+      addTempo(initial.l4_per_minute, song);
+    }
+    if(appendSong(song, &part) != 0)
+      result = -2;
   }
+  free(list);
 
-  return num_notes;
+  if(result == 0 && num_songs == 0) {
+    logMessage("Error: %s does not name any songs!\n", playlist);
+    result = -2;
+  }
+  return result;
 }
 
-unsigned long addSound(double* data, unsigned long offset, double duration, double frequency, unsigned int wave_frequency)
+/**
+ * Internal function to count the notes and samples played by
+ * frequencies, and the samples of their own tones that rendering them
+ * synthesizes.  Phrases are counted from phrase_notes and
+ * phrase_samples, so every phrase they refer to must be counted first.
+ */
+static void estimateFrequencies(const Frequency* frequencies, unsigned long num_frequencies,
+				const unsigned long long* phrase_notes, const unsigned long long* phrase_samples,
+				unsigned long long* notes, unsigned long long* samples, unsigned long long* synthesized)
 {
   unsigned long i;
-  unsigned long iterations = (int)((double)wave_frequency*duration);
-  for(i=0; i<iterations; i++) {
-    data[i + offset] = 32767.0 * sin(2.0 * PI * ((double)(i))*frequency/44100.0);
+  unsigned long long count;
+  Frequency frequency;
+
+  *notes = *samples = *synthesized = 0;
+  for(i=0; i<num_frequencies; i++) {
+    frequency = frequencies[i];
+    if(FREQUENCY_IS_PHRASE(frequency)) {
+      count = PHRASE_COUNT(frequency);
+      *notes = saturatingAdd(*notes, saturatingMultiply(count, phrase_notes[PHRASE_INDEX(frequency)]));
+      *samples = saturatingAdd(*samples, saturatingMultiply(count, phrase_samples[PHRASE_INDEX(frequency)]));
+    }
+    else if(!FREQUENCY_IS_TEMPO(frequency)) {
+      *samples = saturatingAdd(*samples, FREQUENCY_SAMPLES(frequency));
+      if(FREQUENCY_PITCH(frequency) != PITCH_SILENCE && FREQUENCY_SAMPLES(frequency) > 0) {
+	(*notes)++;
+	*synthesized += FREQUENCY_SAMPLES(frequency);
+      }
+    }
   }
-  return offset + iterations;
 }
 
-void writeIC(FILE* file, Frequency* frequency)
+/**
+ * Estimates the cost of converting a song.  This only reads each
+ * frequency once, phrases included, so it costs far less than
+ * converting even a short song.  The phrase_notes of the estimate must
+ * be freed by the caller.
+ */
+void estimateSong(Song* song, SongEstimate* estimate)
 {
-  Frequency* current = frequency;
-
-  fprintf(file, "/**\n * BASIC -> IC Play Statement Conversion\n * Using a Converter Written by Evan A. Sultanik\n * http://www.sultanik.com/\n */\n\n");
-  fprintf(file, "int main()\n{\n");
+  unsigned long long* phrase_samples = (unsigned long long*)malloc(sizeof(unsigned long long) * (song->num_phrases + 1));
+  unsigned long long notes, samples, synthesized;
+  unsigned long i;
 
-  while(current != NULL) {
-    if(current->duration > 0) {
-      if(current->hertz <= 0)
-	fprintf(file, "\tmsleep(%ldL);\n", (long)(current->duration*1000.0));
-      else
-	fprintf(file, "\ttone(%.4f, %.4f);\n", current->hertz, current->duration);
-    }
-    current = current->next;
+  estimate->phrase_notes = (unsigned long long*)malloc(sizeof(unsigned long long) * (song->num_phrases + 1));
+  if(phrase_samples == NULL || estimate->phrase_notes == NULL) {
+    logMessage("ERROR: Could not allocate enough memory!\n");
+    exit(-3);
   }
+  estimate->synthesized = 0;
+  for(i=0; i<song->num_phrases; i++) {
+    estimateFrequencies(song->phrases[i].frequencies, song->phrases[i].num_frequencies,
+			estimate->phrase_notes, phrase_samples, &notes, &samples, &synthesized);
+    estimate->phrase_notes[i] = notes;
+    phrase_samples[i] = samples;
+    estimate->synthesized = saturatingAdd(estimate->synthesized, synthesized);
+  }
+  estimateFrequencies(song->frequencies, song->num_frequencies, estimate->phrase_notes, phrase_samples,
+		      &estimate->notes, &estimate->samples, &synthesized);
+  estimate->synthesized = saturatingAdd(estimate->synthesized, synthesized);
+  free(phrase_samples);
+}
 
-  fprintf(file, "\treturn 1;\n}\n");
+/**
+ * Returns the bytes an output of a song will take, or 0 if that is
+ * not known until it is written.
+ */
+unsigned long long outputSize(Output* output)
+{
+  unsigned long long size;
+  unsigned long i;
+
+  switch(output->conversion_mode) {
+  case CONVERT_TO_WAVE:
+    return waveHeaderSize(output->last - output->first) + 2 * (output->last - output->first);
+  case CONVERT_TO_SONG:
+    size = output->song->num_frequencies + 2 * output->song->num_phrases;
+    for(i=0; i<output->song->num_phrases; i++)
+      size += output->song->phrases[i].num_frequencies;
+    return SONG_HEADER_SIZE + SONG_FREQUENCY_SIZE * size;
+  default:
+    return 0;
+  }
 }
 
-void writeBAS(FILE* file, Frequency* frequency)
+/**
+ * Prints the estimated cost of converting a song to each output.
+ */
+void reportEstimate(SongEstimate* estimate, Output* outputs, unsigned int num_outputs)
 {
-  Frequency* current = frequency;
+  unsigned int i;
+  unsigned long long size;
 
-  fprintf(file, "REM PLAY -> SOUND Statement Conversion\nREM Using a Converter Written by Evan A. Sultanik\nREM http://www.sultanik.com/\n\n");
+  logMessage("Notes:       %llu\n", estimate->notes);
+  logMessage("Length:      %.3f seconds (%llu samples)\n", (double)estimate->samples / SAMPLE_RATE, estimate->samples);
+  logMessage("Synthesis:   at most %llu samples, about %.2f seconds of CPU time\n", estimate->synthesized,
+	     (double)estimate->synthesized * SYNTHESIS_SECONDS_PER_SAMPLE);
+  for(i=0; i<num_outputs; i++) {
+    size = outputSize(&outputs[i]);
+    if(size > 0)
+      logMessage("%s: %llu bytes\n", (outputs[i].filename == NULL) ? "STDOUT" : outputs[i].filename, size);
+    else
+      logMessage("%s: size not known until written\n", (outputs[i].filename == NULL) ? "STDOUT" : outputs[i].filename);
+  }
+}
 
-  while(current != NULL) {
-    if(current->duration > 0) {
-      if(current->hertz < SOUND_HERTZ_LOWEST || current->hertz > SOUND_HERTZ_HIGHEST)
-	fprintf(file, "Seconds = TIMER + %.4f\nDO\nLOOP WHILE TIMER <= Seconds\n", current->duration);
-      else
-	fprintf(file, "SOUND(%d, %.4f);\n", (int)current->hertz, SOUND_DURATION(current->duration));
+/**
+ * Returns the sample at which the note after the first notes of a song
+ * or phrase starts, or its total_samples if it has no more notes.
+ *
+ * root - the song whose phrases the frequencies refer to
+ */
+unsigned long long noteStart(Song* song, Song* root, const unsigned long long* phrase_notes, unsigned long long notes)
+{
+  unsigned long long* timeline = songTimeline(song, root);
+  unsigned long long played, plays;
+  unsigned long i, index;
+  Frequency frequency;
+
+  for(i=0; i<song->num_frequencies; i++) {
+    frequency = song->frequencies[i];
+    if(FREQUENCY_IS_PHRASE(frequency)) {
+      index = PHRASE_INDEX(frequency);
+      if(phrase_notes[index] == 0)
+	continue;
+      played = saturatingMultiply(PHRASE_COUNT(frequency), phrase_notes[index]);
+      if(notes < played) {
+	plays = notes / phrase_notes[index];
+	return timeline[i] + plays * root->phrases[index].total_samples +
+	  noteStart(&root->phrases[index], root, phrase_notes, notes - plays * phrase_notes[index]);
+      }
+      notes -= played;
+    }
+    else if(!FREQUENCY_IS_TEMPO(frequency) && FREQUENCY_PITCH(frequency) != PITCH_SILENCE &&
+	    FREQUENCY_SAMPLES(frequency) > 0) {
+      if(notes == 0)
+	return timeline[i];
+      notes--;
     }
-    current = current->next;
   }
+  return timeline[song->num_frequencies];
 }
 
-char* getFileSuffix(char* string)
+/**
+ * Internal function to append to cut the frequencies of a song or
+ * phrase that play before sample samples.  A phrase cut part way
+ * through is played as many whole times as fit, followed by the part
+ * of it that is left.
+ */
+static void truncateFrequencies(Song* song, Song* root, unsigned long long samples, Song* cut)
 {
-  int i, last_period = -1;
-  if(string == NULL)
-    return NULL;
-  for(i=0; string[i] != '\0'; i++) {
-    if(string[i] == '.')
-      last_period = i;
+  unsigned long long* timeline = songTimeline(song, root);
+  unsigned long long remaining, plays;
+  unsigned long i, index;
+  Frequency frequency;
+
+  for(i=0; i<song->num_frequencies && timeline[i] < samples; i++) {
+    frequency = song->frequencies[i];
+    if(timeline[i+1] <= samples) {
+      appendFrequency(frequency, cut);
+      continue;
+    }
+    remaining = samples - timeline[i];
+    if(FREQUENCY_IS_PHRASE(frequency)) {
+      index = PHRASE_INDEX(frequency);
+      plays = remaining / root->phrases[index].total_samples;
+      if(plays > 0)
+	appendFrequency(PHRASE_REFERENCE(index, plays), cut);
+      truncateFrequencies(&root->phrases[index], root, remaining - plays * root->phrases[index].total_samples, cut);
+    }
+    else
+      appendFrequency(FREQUENCY(FREQUENCY_PITCH(frequency), remaining), cut);
   }
-  if(last_period < 0 || last_period >= i - 1)
-    return NULL;
-  return string + last_period + 1;
 }
 
-void readFile(FILE* file, char** string)
+/**
+ * Cuts a song off after its first samples samples.  Its phrases are
+ * left as they are, since only the song's own frequencies change.
+ */
+void truncateSong(Song* song, unsigned long long samples)
 {
-  char buffer[255];
-  char* temp;
-  int num_read;
-  int length = 0;
+  Song cut;
 
-  *string = NULL;
+  if(samples >= song->total_samples)
+    return;
+  memset(&cut, 0, sizeof(Song));
+  truncateFrequencies(song, song, samples, &cut);
+  if(song->capacity > 0)
+    free(song->frequencies);
+  free(song->timeline);
+  song->timeline = NULL;
+  song->frequencies = cut.frequencies;
+  song->num_frequencies = cut.num_frequencies;
+  song->capacity = cut.capacity;
+  song->total_samples = samples;
+}
 
-  while((num_read = fread(buffer, sizeof(char), 255, file))) {
-    length += num_read;
-    temp = *string;
-    *string = (char*)malloc(sizeof(char) * (length + 1));
-    if(temp != NULL) {
-      strcpy(*string, temp);
-      strncpy(*string + strlen(temp), buffer, num_read);
-      (*string + strlen(temp))[num_read] = '\0';
-      free(temp);
-    }
-    else {
-      strncpy(*string, buffer, num_read);
-      (*string)[num_read] = '\0';
-    }
+/**
+ * Returns the conversion to make to a file with filename's suffix, or
+ * CONVERSION_NOT_SELECTED if the suffix does not correspond to a file
+ * format.
+ */
+int suffixConversion(char* filename)
+{
+  char* suffix = getFileSuffix(filename);
+
+  if(suffix == NULL)
+    return CONVERSION_NOT_SELECTED;
+  if((strcasecmp("c", suffix) == 0) || 
+     (strcasecmp("ic", suffix) == 0) ||
+     (strcasecmp("cc", suffix) == 0))
+    return CONVERT_TO_IC;
+  if((strcasecmp("wav", suffix) == 0) ||
+     (strcasecmp("wave", suffix) == 0))
+    return CONVERT_TO_WAVE;
+  if((strcasecmp("bas", suffix) == 0) ||
+     (strcasecmp("basic", suffix) == 0))
+    return CONVERT_TO_BAS;
+  if((strcasecmp("mid", suffix) == 0) ||
+     (strcasecmp("midi", suffix) == 0))
+    return CONVERT_TO_MIDI;
+  if(strcasecmp("bps", suffix) == 0)
+    return CONVERT_TO_SONG;
+  return CONVERSION_NOT_SELECTED;
+}
+
+/**
+ * Writes one output of a song.  When several outputs are asked for,
+ * they are written in parallel by runInParallel(), all reading the
+ * same song.
+ */
+void* writeOutput(void* data)
+{
+  Output* output = (Output*)data;
+  FILE* file;
+
+  if(output->conversion_mode == CONVERT_TO_WAVE && output->filename != NULL &&
+     output->first == 0 && output->last == output->song->total_samples) {
+    output->result = writeWaveFile(output->filename, output->song);
+    return NULL;
+  }
+  if(output->filename == NULL)
+    file = stdout;
+  else if((file = fopen(output->filename, "wb")) == NULL) {
+    logMessage("Error: could not open %s for writing: %s\n", output->filename, strerror(errno));
+    output->result = -1;
+    return NULL;
   }
-  if(*string == NULL) {
-    *string = (char*)malloc(sizeof(char) * 1);
-    (*string)[0] = '\0';
+
+  switch(output->conversion_mode) {
+  case CONVERT_TO_IC:
+    output->result = writeIC(file, output->song);
+    break;
+  case CONVERT_TO_BAS:
+    writeBAS(file, output->song);
+    break;
+  case CONVERT_TO_SONG:
+    output->result = writeSong(file, output->song);
+    break;
+  case CONVERT_TO_MIDI:
+    output->result = writeMidi(file, output->song);
+    break;
+  case CONVERT_TO_WAVE:
+  default:
+    output->result = writeWave(file, output->song, output->first, output->last);
+    break;
   }
+
+  if(output->filename != NULL)
+    fclose(file);
+  return NULL;
 }
 
 int fileExists(char* filename)
@@ -827,21 +4671,40 @@ int fileExists(char* filename)
 
 int main(const int argc, char** argv)
 {
-  FILE* file = NULL;
-  double* data;
-  unsigned long num_notes;
-  double total_duration, offset = 0;
-  Frequency* first_frequency;
-  Frequency* current_frequency;
-  Note* head;
+  int result = 0;
+  Song song = {0};
   short print_usage = 0;
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
   int i;
   char* input_string = NULL;
   int conversion_mode = CONVERSION_NOT_SELECTED;
   int force = 0;
   char* input_file = NULL;
   char* output_file = NULL;
+  char* playlist_file = NULL;
+  double gap = 0.0;
+  char* gap_end;
+  int use_gap = 0;
   int use_stdout = 0;
+  int use_range = 0;
+  double range_start = 0.0, range_end = -1.0;
+  char* range_end_string;
+  unsigned long long first = 0, last = 0;
+  Output* outputs = (Output*)calloc(argc + 1, sizeof(Output));
+  unsigned int num_outputs = 0;
+  unsigned int output;
+  unsigned long phrase;
+  int ranged = 0;
+  double max_seconds = 0.0;
+  unsigned long long max_notes = 0, max_bytes = 0, cut, size;
+  int truncate_song = 0;
+  int show_estimate = 0;
+  SongEstimate estimate = {0};
+
+  if(outputs == NULL) {
+    logMessage("ERROR: Could not allocate enough memory!\n");
+    return -3;
+  }
 
   /**
    * Read the command line arguments
@@ -850,7 +4713,7 @@ int main(const int argc, char** argv)
     print_usage = 3;
   }
   for(i=1; i<argc; i++) {
-    if(strncmp(argv[i], "-e", 2) == 0) {
+    if(strncmp(argv[i], "-e", 2) == 0 && strcmp(argv[i], "-estimate") != 0) {
       if(strcmp(argv[i], "-e") == 0) {
 	if(argc - 1 == i) {
 	  logMessage("Error: PLAY statement expected after -e option!\n\n");
@@ -859,7 +4722,7 @@ int main(const int argc, char** argv)
 	}
 	/* The next argument should be the play statement */
 	input_string = (char*)malloc(sizeof(char) * (strlen(argv[i+1]) + 1));
-	strcpy(input_string, argv[i++]);
+	strcpy(input_string, argv[++i]);
       }
       else {
 	if(strlen(argv[i]) <= 2) {
@@ -889,9 +4752,142 @@ int main(const int argc, char** argv)
     else if(strcmp(argv[i], "-bas") == 0) {
       conversion_mode = CONVERT_TO_BAS;
     }
+    else if(strncmp(argv[i], "-x", 2) == 0) {
+      if(strcmp(argv[i], "-x") == 0) {
+	if(argc - 1 == i) {
+	  logMessage("Error: sub-string definition expected after -x option!\n\n");
+	  print_usage = 1;
+	  break;
+	}
+	i++;
+      }
+      if(defineSubstring((strncmp(argv[i], "-x", 2) == 0) ? argv[i]+2 : argv[i]) != 0) {
+	logMessage("Error: '%s' is not a valid sub-string definition!\n\n", argv[i]);
+	print_usage = 1;
+	break;
+      }
+    }
+    else if(strcmp(argv[i], "-mid") == 0) {
+      conversion_mode = CONVERT_TO_MIDI;
+    }
+    else if(strcmp(argv[i], "-compile") == 0) {
+      conversion_mode = CONVERT_TO_SONG;
+    }
     else if(strcmp(argv[i], "-f") == 0) {
       force = 1;
     }
+    else if(strcmp(argv[i], "-maxerrors") == 0) {
+      if(argc - 1 == i || argv[i+1][0] < '0' || argv[i+1][0] > '9') {
+	logMessage("Error: number of errors expected after -maxerrors option!\n\n");
+	print_usage = 1;
+	break;
+      }
+      max_diagnostics = strtoul(argv[++i], NULL, 10);
+    }
+    else if(strcmp(argv[i], "-json") == 0) {
+      json_diagnostics = 1;
+    }
+    else if(strcmp(argv[i], "-ring") == 0) {
+      if(argc - 1 == i || argv[i+1][0] < '1' || argv[i+1][0] > '9') {
+	logMessage("Error: number of blocks expected after -ring option!\n\n");
+	print_usage = 1;
+	break;
+      }
+      ring_depth = strtoul(argv[++i], NULL, 10);
+    }
+    else if(strcmp(argv[i], "-ringstats") == 0) {
+      ring_stats = 1;
+    }
+    else if(strcmp(argv[i], "-maxseconds") == 0) {
+      if(argc - 1 == i || ((argv[i+1][0] < '0' || argv[i+1][0] > '9') && argv[i+1][0] != '.')) {
+	logMessage("Error: number of seconds expected after -maxseconds option!\n\n");
+	print_usage = 1;
+	break;
+      }
+      max_seconds = strtod(argv[++i], NULL);
+    }
+    else if(strcmp(argv[i], "-maxnotes") == 0) {
+      if(argc - 1 == i || argv[i+1][0] < '0' || argv[i+1][0] > '9') {
+	logMessage("Error: number of notes expected after -maxnotes option!\n\n");
+	print_usage = 1;
+	break;
+      }
+      max_notes = strtoull(argv[++i], NULL, 10);
+    }
+    else if(strcmp(argv[i], "-maxbytes") == 0) {
+      if(argc - 1 == i || argv[i+1][0] < '0' || argv[i+1][0] > '9') {
+	logMessage("Error: number of bytes expected after -maxbytes option!\n\n");
+	print_usage = 1;
+	break;
+      }
+      max_bytes = strtoull(argv[++i], NULL, 10);
+    }
+    else if(strcmp(argv[i], "-playlist") == 0) {
+      if(argc - 1 == i) {
+	logMessage("Error: playlist filename expected after -playlist option!\n\n");
+	print_usage = 1;
+	break;
+      }
+      playlist_file = argv[++i];
+    }
+    else if(strcmp(argv[i], "-gap") == 0) {
+      if(argc - 1 == i || ((argv[i+1][0] < '0' || argv[i+1][0] > '9') && argv[i+1][0] != '.')) {
+	logMessage("Error: number of seconds expected after -gap option!\n\n");
+	print_usage = 1;
+	break;
+      }
+      i++;
+      gap = strtod(argv[i], &gap_end);
+      /* the gap is a silence, whose samples must fit in a frequency */
+      if(*gap_end != '\0' || !(gap >= 0.0 && gap * SAMPLE_RATE < (double)MAX_SONG_SAMPLES)) {
+	logMessage("Error: '%s' is not a valid number of seconds for -gap!\n\n", argv[i]);
+	print_usage = 1;
+	break;
+      }
+      use_gap = 1;
+    }
+    else if(strcmp(argv[i], "-truncate") == 0) {
+      truncate_song = 1;
+    }
+    else if(strcmp(argv[i], "-estimate") == 0) {
+      show_estimate = 1;
+    }
+    else if(strcmp(argv[i], "-o") == 0) {
+      if(argc - 1 == i) {
+	logMessage("Error: output filename expected after -o option!\n\n");
+	print_usage = 1;
+	break;
+      }
+      outputs[num_outputs++].filename = argv[++i];
+    }
+    else if(strcmp(argv[i], "-range") == 0) {
+      if(argc - 1 == i || strchr(argv[i+1], ':') == NULL) {
+	logMessage("Error: start:end expected after -range option!\n\n");
+	print_usage = 1;
+	break;
+      }
+      i++;
+      range_start = (argv[i][0] == ':') ? 0.0 : strtod(argv[i], NULL);
+      range_end_string = strchr(argv[i], ':') + 1;
+      range_end = (*range_end_string == '\0') ? -1.0 : strtod(range_end_string, NULL);
+      if(range_start < 0.0 || (range_end >= 0.0 && range_end < range_start)) {
+	logMessage("Error: '%s' is not a valid range of seconds!\n\n", argv[i]);
+	print_usage = 1;
+	break;
+      }
+      use_range = 1;
+    }
+    else if(strncmp(argv[i], "-j", 2) == 0) {
+      if(strcmp(argv[i], "-j") == 0)
+	num_threads = (argc - 1 == i) ? 0 : atoi(argv[++i]);
+      else
+	num_threads = atoi(argv[i]+2);
+      if(num_threads < 1) {
+	logMessage("Error: number of threads expected after -j option!\n\n");
+	print_usage = 1;
+	break;
+      }
+    }
     else if(strncmp(argv[i], "-", 1) == 0) {
       logMessage("Error: unknown option '%s'!\n\n", argv[i]);
     }
@@ -907,134 +4903,255 @@ int main(const int argc, char** argv)
       }
     }
   }
+  if(!print_usage && playlist_file != NULL) {
+    /* With a playlist, the only file named is the output file */
+    if(input_string != NULL || output_file != NULL) {
+      logMessage("Error: -playlist cannot be used with an input PLAY statement!\n\n");
+      print_usage = 1;
+    }
+    output_file = input_file;
+    input_file = NULL;
+  }
+  if(!print_usage && use_gap && playlist_file == NULL) {
+    logMessage("Error: -gap can only be used with -playlist\n\n");
+    print_usage = 1;
+  }
   if(!print_usage) {
-    if((input_file == NULL && input_string == NULL)) {
+    if(input_file == NULL && input_string == NULL && playlist_file == NULL) {
       logMessage("Error: input PLAY statement not provided!\n\n");
       print_usage = 1;
     }
-    if(output_file == NULL && !use_stdout) {
+    if(output_file == NULL && !use_stdout && num_outputs == 0 && !show_estimate) {
       logMessage("Error: output filename not provided!\n\n");
       print_usage = 1;
     }
   }
-  if(!print_usage && conversion_mode == CONVERSION_NOT_SELECTED) {
-    if(use_stdout) {
+  /**
+   * Outputs given with -o are converted according to their suffixes,
+   * and the output file or STDOUT according to the conversion option
+   */
+  for(output=0; output<num_outputs && !print_usage; output++) {
+    outputs[output].conversion_mode = suffixConversion(outputs[output].filename);
+    if(outputs[output].conversion_mode == CONVERSION_NOT_SELECTED)
+      outputs[output].conversion_mode = conversion_mode;
+    if(outputs[output].conversion_mode == CONVERSION_NOT_SELECTED) {
       print_usage = 1;
-      logMessage("Error: you must specify the type of conversion when outputting to STDOUT\n\n");
+      logMessage("Error: filetype '%s' unknown; please specify the type of conversion\n\n", getFileSuffix(outputs[output].filename));
     }
-    else {
-      int error = 0;
-      char* suffix = getFileSuffix(output_file);
-      if(suffix == NULL) {
-	error = 1;
-      }
-      else if((strcasecmp("c", suffix) == 0) || 
-	      (strcasecmp("ic", suffix) == 0) ||
-	      (strcasecmp("cc", suffix) == 0)) {
-	conversion_mode = CONVERT_TO_IC;
-      }
-      else if((strcasecmp("wav", suffix) == 0) ||
-	      (strcasecmp("wave", suffix) == 0)) {
-      conversion_mode = CONVERT_TO_WAVE;
-      }
-      else if((strcasecmp("bas", suffix) == 0) ||
-	      (strcasecmp("basic", suffix) == 0)) {
-	conversion_mode = CONVERT_TO_BAS;
-      }
-      else {
-	error = 1;
+  }
+  if(!print_usage && (output_file != NULL || use_stdout)) {
+    if(conversion_mode == CONVERSION_NOT_SELECTED) {
+      if(use_stdout) {
+	print_usage = 1;
+	logMessage("Error: you must specify the type of conversion when outputting to STDOUT\n\n");
       }
-      
-      if(error) {
+      else if((conversion_mode = suffixConversion(output_file)) == CONVERSION_NOT_SELECTED) {
 	print_usage = 1;
-	logMessage("Error: filetype '%s' unknown; please specify the type of conversion\n\n", suffix);
+	logMessage("Error: filetype '%s' unknown; please specify the type of conversion\n\n", getFileSuffix(output_file));
       }
     }
+    outputs[num_outputs].filename = use_stdout ? NULL : output_file;
+    outputs[num_outputs++].conversion_mode = conversion_mode;
+  }
+  for(output=0; output<num_outputs && !print_usage; output++) {
+    if(outputs[output].conversion_mode == CONVERT_TO_WAVE)
+      ranged = 1;
   }
-  if(!print_usage && !force && !use_stdout && fileExists(output_file)) {
+  if(!print_usage && use_range && !ranged && num_outputs > 0) {
     print_usage = 1;
-    logMessage("Error: file '%s' is in the way!  Use '-f' option to force overwrite.\n\n", output_file);
+    logMessage("Error: -range can only be used when rendering a WAVE file\n\n");
+  }
+  for(output=0; output<num_outputs && !print_usage && !force && !show_estimate; output++) {
+    if(outputs[output].filename != NULL && fileExists(outputs[output].filename)) {
+      print_usage = 1;
+      logMessage("Error: file '%s' is in the way!  Use '-f' option to force overwrite.\n\n", outputs[output].filename);
+    }
   }
   if(print_usage) {
     logMessage("Version: BasicPlay %s\n", VERSION);
     logMessage("Copyright: Copyright (C) 2004 Evan Sultanik\n");
     logMessage("http://www.sultanik.com/\n\n");
-    logMessage("Usage: basicplay [options ...] [file | -e 'statement'] [options ...] [file | -c]\n\n");
+    logMessage("Usage: basicplay [options ...] [file | -e 'statement' | -playlist list] [options ...] [file | -c | -o file ...]\n\n");
     logMessage("Where options include:\n");
     logMessage("  -wav render the input PLAY statement to a WAVE sound file\n");
     logMessage("  -ic  convert the input PLAY statement to Interactive C code\n");
     logMessage("       that will play the music on a device such as a Handyboard\n");
     logMessage("  -bas convert the input PLAY statement to BASIC code,\n");
     logMessage("       using the SOUND statement instead of PLAY\n");
+    logMessage("  -mid convert the input PLAY statement to a Standard MIDI File\n");
+    logMessage("  -compile\n");
+    logMessage("       compile the input PLAY statement to a BasicPlay song, which BasicPlay\n");
+    logMessage("       can later read in place of the statement without parsing it again\n");
     logMessage("  -e   used in place of an input file, this option must be followed by a string\n");
     logMessage("       containing the PLAY statement to be converted\n");
+    logMessage("  -x   followed by NAME=statement, defines a sub-string that PLAY statements\n");
+    logMessage("       can execute with XNAME; or, to execute it several times, XNAME*count;\n");
+    logMessage("  -playlist\n");
+    logMessage("       used in place of an input file, this option must be followed by a file\n");
+    logMessage("       listing songs, one to a line, to be converted one after another as a\n");
+    logMessage("       single song\n");
+    logMessage("  -gap followed by the seconds of silence to leave between the songs of a\n");
+    logMessage("       -playlist; defaults to 0\n");
     logMessage("  -c   output to STDOUT instead of a file\n");
+    logMessage("  -o   followed by a file to convert the input PLAY statement to as well, in\n");
+    logMessage("       the format its suffix gives; may be given several times, and the\n");
+    logMessage("       outputs are all written from a single parse\n");
     logMessage("  -f   force an overwrite of the output file, even if it already exists\n");
-    logMessage("\nIf neither -wav, -bas, nor -ic options are given, BasicPlay will determine the\n");
-    logMessage("conversion by the output file suffix.  For example, *.wav[e] will result in a\n");
-    logMessage("WAVE file, *.[i]c will result in an Interactive C file, and *.bas[ic] will\n");
-    logMessage("result in a BASIC file.  If the output file suffix does not correspond to a\n");
-    logMessage("file format, an error will be thrown and the conversion will not occur.\n");
+    logMessage("  -j   followed by the number of threads used to parse very long statements;\n");
+    logMessage("       defaults to the number of processors\n");
+    logMessage("  -maxerrors\n");
+    logMessage("       followed by the most syntax errors and warnings to print, or 0 to print\n");
+    logMessage("       them all; defaults to %d\n", DEFAULT_MAX_DIAGNOSTICS);
+    logMessage("  -json\n");
+    logMessage("       print syntax errors and warnings as JSON objects, one to a line\n");
+    logMessage("  -ring\n");
+    logMessage("       followed by the number of %d KB blocks a WAVE file written to STDOUT\n", RING_BLOCK_SIZE / 1024);
+    logMessage("       may be rendered ahead of being written; defaults to %d\n", DEFAULT_RING_DEPTH);
+    logMessage("  -range\n");
+    logMessage("       followed by start:end, renders only the seconds from start to end of\n");
+    logMessage("       the song to the WAVE file; either may be left out\n");
+    logMessage("  -ringstats\n");
+    logMessage("       print how long rendering and writing a WAVE file to STDOUT waited on\n");
+    logMessage("       each other, to help choose the -ring depth\n");
+    logMessage("  -maxseconds\n");
+    logMessage("       followed by the longest song, in seconds, that may be converted\n");
+    logMessage("  -maxnotes\n");
+    logMessage("       followed by the most notes, counting repetitions, a song may play\n");
+    logMessage("  -maxbytes\n");
+    logMessage("       followed by the largest WAVE file or BasicPlay song that may be written\n");
+    logMessage("  -truncate\n");
+    logMessage("       cut a song off at the -maxseconds, -maxnotes or -maxbytes limit\n");
+    logMessage("       instead of refusing to convert it\n");
+    logMessage("  -estimate\n");
+    logMessage("       print the notes, length and output sizes of the song, and the CPU\n");
+    logMessage("       time rendering it should take, without writing anything\n");
+    logMessage("\nIf neither -wav, -bas, -ic, -mid, nor -compile options are given, BasicPlay\n");
+    logMessage("will determine the conversion by the output file suffix.  For example, *.wav[e]\n");
+    logMessage("will result in a WAVE file, *.[i]c will result in an Interactive C file,\n");
+    logMessage("*.bas[ic] will result in a BASIC file, *.mid[i] will result in a MIDI file, and\n");
+    logMessage("*.bps will result in a BasicPlay song.  If the output file suffix does not\n");
+    logMessage("correspond to a file format, an error will be thrown and the conversion will\n");
+    logMessage("not occur.\n");
     return -1;
   }
 
-  if(input_string == NULL) {
-    file = fopen(input_file, "rb");
-    if(file == NULL) {
-      logMessage("Error: could not open %s for reading!\n", input_file);
-      return -2;
-    }
-    readFile(file, &input_string);
-    fclose(file);
-  }
-
-  head = (Note*)malloc(sizeof(Note));
-  first_frequency = (Frequency*)malloc(sizeof(Frequency));
-
-  num_notes = parsePlayStatement(input_string, strlen(input_string), head);
-
-  total_duration = notesToFrequency(head, first_frequency);
+  initPitches();
 
-  freeNotes(head);
-
-  data = (double*)malloc(sizeof(double) * CEILING(total_duration * 44100.0));
+  if(num_threads < 1)
+    num_threads = 1;
+  if(playlist_file != NULL)
+    result = readPlaylist(playlist_file, gap, num_threads, &song);
+  else
+    result = readSong(input_file, input_string, num_threads, &song);
+  if(result != 0)
+    return result;
 
-  if(data == NULL) {
-    logMessage("ERROR: Could not allocate enough memory!\n");
-    return -3;
+  /**
+   * Songs over the limits are refused, or cut off with -truncate, from
+   * an estimate made before any output is written
+   */
+  if(max_seconds > 0.0 || max_notes > 0 || max_bytes > 0 || show_estimate) {
+    estimateSong(&song, &estimate);
+    cut = song.total_samples;
+    if(estimate.samples != song.total_samples) {
+      logMessage("Error: the song is too long to be measured!\n");
+      result = -4;
+    }
+    else if(max_notes > 0 && estimate.notes > max_notes) {
+      if(truncate_song)
+	cut = noteStart(&song, &song, estimate.phrase_notes, max_notes);
+      else {
+	logMessage("Error: the song plays %llu notes, more than the %llu allowed by -maxnotes!\n", estimate.notes, max_notes);
+	result = -4;
+      }
+    }
+    if(result == 0 && max_seconds > 0.0 && estimate.samples > (unsigned long long)llround(max_seconds * SAMPLE_RATE)) {
+      if(truncate_song) {
+	if(cut > (unsigned long long)llround(max_seconds * SAMPLE_RATE))
+	  cut = (unsigned long long)llround(max_seconds * SAMPLE_RATE);
+      }
+      else {
+	logMessage("Error: the song is %.3f seconds long, more than the %g allowed by -maxseconds!\n",
+		   (double)estimate.samples / SAMPLE_RATE, max_seconds);
+	result = -4;
+      }
+    }
+    if(result == 0 && cut < song.total_samples) {
+      truncateSong(&song, cut);
+      free(estimate.phrase_notes);
+      estimateSong(&song, &estimate);
+    }
   }
 
-  current_frequency = first_frequency;
-
-  while(current_frequency != NULL) {
-    offset = addSound(data, offset, current_frequency->duration, current_frequency->hertz, 44100);
-    current_frequency = current_frequency->next;
+  first = 0;
+  last = song.total_samples;
+  if(use_range) {
+    if((unsigned long long)llround(range_start * SAMPLE_RATE) < last)
+      first = (unsigned long long)llround(range_start * SAMPLE_RATE);
+    else
+      first = last;
+    if(range_end >= 0.0 && (unsigned long long)llround(range_end * SAMPLE_RATE) < last)
+      last = (unsigned long long)llround(range_end * SAMPLE_RATE);
   }
 
-  if(use_stdout)
-    file = stdout;
-  else
-    file = fopen(output_file, "wb");
-
-  switch(conversion_mode) {
-  case CONVERT_TO_IC:
-    writeIC(file, first_frequency);
-    break;
-  case CONVERT_TO_BAS:
-    writeBAS(file, first_frequency);
-    break;
-  case CONVERT_TO_WAVE:
-  default:
-    writeWave(file, data, total_duration * 44100, 44100);
-    break;    
+  ranged = 0;
+  for(output=0; output<num_outputs; output++) {
+    outputs[output].song = &song;
+    outputs[output].last = song.total_samples;
+    if(outputs[output].conversion_mode == CONVERT_TO_WAVE) {
+      outputs[output].first = first;
+      outputs[output].last = last;
+    }
+    size = outputSize(&outputs[output]);
+    if(result != 0 || max_bytes == 0 || size <= max_bytes)
+      continue;
+    if(truncate_song && outputs[output].conversion_mode == CONVERT_TO_WAVE && max_bytes >= WAVE_HEADER_SIZE) {
+      outputs[output].last = outputs[output].first + (max_bytes - WAVE_HEADER_SIZE) / 2;
+      if(waveHeaderSize(outputs[output].last - outputs[output].first) == RF64_HEADER_SIZE)
+	outputs[output].last = outputs[output].first + (max_bytes - RF64_HEADER_SIZE) / 2;
+    }
+    else {
+      logMessage("Error: %s would be %llu bytes, more than the %llu allowed by -maxbytes!\n",
+		 (outputs[output].filename == NULL) ? "STDOUT" : outputs[output].filename, size, max_bytes);
+      result = -4;
+    }
+  }
+  for(output=0; output<num_outputs; output++) {
+    if(outputs[output].conversion_mode == CONVERT_TO_WAVE &&
+       (outputs[output].first != 0 || outputs[output].last != song.total_samples))
+      ranged = 1;
+  }
+  if(result == 0 && show_estimate)
+    reportEstimate(&estimate, outputs, num_outputs);
+  free(estimate.phrase_notes);
+  if(result != 0 || show_estimate) {
+    free(outputs);
+    freeSong(&song);
+    freeSubstrings();
+    free(input_string);
+    return (result != 0) ? -4 : 1;
   }
 
-  if(!use_stdout)
-    fclose(file);
+  if(ranged) {
+    /* The outputs share the song, so its timelines are built before
+       they are written in parallel */
+    songTimeline(&song, &song);
+    for(phrase=0; phrase<song.num_phrases; phrase++)
+      songTimeline(&song.phrases[phrase], &song);
+  }
+  runInParallel(writeOutput, outputs, sizeof(Output), num_outputs);
+  for(output=0; output<num_outputs; output++) {
+    if(outputs[output].result != 0)
+      result = outputs[output].result;
+  }
+  free(outputs);
 
-  freeFrequencies(first_frequency);
-  free(data);
+  freeSong(&song);
+  freeSubstrings();
   free(input_string);
 
+  if(result != 0)
+    return -3;
+
   return 1;
 }
@@ -0,0 +1,156 @@
+/**
+ * fixed.c
+ *
+ * Checks that putCodeFixed() writes every value exactly as printf's
+ * "%.4f" does: zero and negative zero, values that fall on or next to
+ * a rounding boundary of .00005, tiny and huge magnitudes, and a run
+ * of random doubles.  Given "bench", it also times putCodeFixed()
+ * against snprintf().
+ *
+ * usage: tests/fixed [bench]
+ */
+
+#define main basicplay_main
+#include "../basicplay.c"
+#undef main
+
+#include <float.h>
+#include <time.h>
+
+#define RANDOM_VALUES 500000
+#define BENCH_VALUES 5000000
+
+static unsigned long long state = 0x9e3779b97f4a7c15ULL;
+
+/* xorshift, so that every run checks the same values */
+static unsigned long long nextRandom(void)
+{
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+}
+
+static int failures = 0;
+
+static void check(double value)
+{
+  CodeBuffer buffer;
+  char expected[512];
+  int length;
+
+  buffer.file = stdout;
+  buffer.length = 0;
+  putCodeFixed(&buffer, value);
+  length = snprintf(expected, sizeof(expected), "%.4f", value);
+  if((size_t)length != buffer.length || memcmp(expected, buffer.data, length) != 0) {
+    if(failures++ < 20)
+      fprintf(stderr, "putCodeFixed(%a) gave \"%.*s\", printf gave \"%s\"\n",
+              value, (int)buffer.length, buffer.data, expected);
+  }
+}
+
+/* checks value and its neighbours on both sides, with both signs */
+static void checkAround(double value)
+{
+  check(value);
+  check(-value);
+  check(nextafter(value, 0.0));
+  check(-nextafter(value, 0.0));
+  check(nextafter(value, INFINITY));
+  check(-nextafter(value, INFINITY));
+}
+
+static double seconds(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void bench(void)
+{
+  static double values[BENCH_VALUES];
+  CodeBuffer* buffer;
+  char text[64];
+  double start, fixed, printed;
+  size_t total = 0;
+  long i;
+
+  buffer = (CodeBuffer*)malloc(sizeof(CodeBuffer));
+  buffer->file = fopen("/dev/null", "w");
+  buffer->length = 0;
+  if(buffer->file == NULL) {
+    perror("/dev/null");
+    exit(1);
+  }
+  /* the sort of values a song's tone table holds: hertz and seconds */
+  for(i=0; i<BENCH_VALUES; i++)
+    values[i] = (i & 1) ? 20.0 + (nextRandom() % 2000000) / 100.0 : (nextRandom() % 100000) / 9973.0;
+
+  start = seconds();
+  for(i=0; i<BENCH_VALUES; i++)
+    putCodeFixed(buffer, values[i]);
+  flushCode(buffer);
+  fixed = seconds() - start;
+
+  start = seconds();
+  for(i=0; i<BENCH_VALUES; i++)
+    total += snprintf(text, sizeof(text), "%.4f", values[i]);
+  printed = seconds() - start;
+
+  printf("putCodeFixed: %.1f ns a value\n", fixed * 1e9 / BENCH_VALUES);
+  printf("snprintf:     %.1f ns a value (%lu bytes)\n", printed * 1e9 / BENCH_VALUES, (unsigned long)total);
+  fclose(buffer->file);
+  free(buffer);
+}
+
+int main(int argc, char** argv)
+{
+  static const double edges[] = {
+    0.0, 1.0, 0.5, 0.1, 0.25, 0.00005, 0.00015, 0.00025, 0.99995, 9.99995,
+    1.00005, 2.00015, 0.12345, 0.12355, 123.45675, 440.0, 27.5, 4186.0090,
+    4294967295.0, 9007199254740991.0, 9007199254740992.0, 1e14, 999999999999999.0,
+    1e15, 1.5e15, 1e16, 1e20, 1e300, DBL_MAX, DBL_MIN, 5e-324, 1e-5, 4.9999e-5
+  };
+  unsigned long long bits;
+  double value;
+  long i;
+
+  check(-0.0);
+  check(INFINITY);
+  check(-INFINITY);
+  check(NAN);
+  for(i=0; i<(long)(sizeof(edges) / sizeof(edges[0])); i++)
+    checkAround(edges[i]);
+
+  /* every half-way point between two four-digit fractions, near zero
+   * and near the size of a 32-bit sample count */
+  for(i=0; i<200000; i++) {
+    checkAround(i / 10000.0 + 0.00005);
+    checkAround((i * 2 + 1) / 20000.0);
+    checkAround(4294967296.0 + (i * 2 + 1) / 20000.0);
+  }
+  /* every power of two, from the smallest denormal to the largest */
+  for(i=-1074; i<1024; i++)
+    checkAround(ldexp(1.0, i));
+
+  for(i=0; i<RANDOM_VALUES; i++) {
+    /* random bit patterns, which cover every exponent ... */
+    bits = nextRandom();
+    memcpy(&value, &bits, sizeof(value));
+    check(value);
+    /* ... and random values of the size a song uses */
+    check((double)(nextRandom() % 100000000000ULL) / (double)(1 + nextRandom() % 100000));
+  }
+
+  if(failures > 0) {
+    fprintf(stderr, "putCodeFixed: %d values differ from printf\n", failures);
+    return 1;
+  }
+  printf("putCodeFixed: ok\n");
+  if(argc > 1 && strcmp(argv[1], "bench") == 0)
+    bench();
+  return 0;
+}
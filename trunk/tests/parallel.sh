@@ -0,0 +1,74 @@
+#!/bin/sh
+# Checks that parsing a long PLAY statement in parallel gives exactly
+# the song and the syntax errors that parsing it serially does, for
+# valid statements and for ones full of errors.  The statements are
+# long enough to be split, and random enough that splits fall in the
+# middle of commands.  Some also change the music mode, which has to
+# be carried from one chunk to the next, and some play sub-strings,
+# which makes the chunks be converted one after another.
+#
+# usage: tests/parallel.sh [basicplay]
+
+BASICPLAY=${1:-./basicplay}
+WORK=${TMPDIR:-/tmp}/basicplay-parallel.$$
+FAILED=0
+
+mkdir -p "$WORK" || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+# sub-strings for the statements to play; each leaves the music state
+# changed, so where it is played from matters
+SUBSTRINGS="-xUP=>CEG -xDOWN=MSL16>C<BA -xLEGATO=MLT200L8DF#A -xNEST=MNXUP;P8XDOWN;"
+
+# prints a random statement of about $2 characters, mostly valid if $3
+# is 0 and full of stray symbols otherwise, that changes the music mode
+# if $4 is 1 or more and plays sub-strings if it is 2
+generate()
+{
+  awk -v seed="$1" -v size="$2" -v noise="$3" -v extras="$4" 'BEGIN {
+    srand(seed);
+    notes = "CDEFGAB"; commands = "LOTP"; symbols = "ABCDEFGabcdefg#+-.0123456789LOPTMNSlopt<> ;*?!X";
+    modes = "NLS"; split("UP DOWN LEGATO NEST", names, " ");
+    for(n = 0; n < size; ) {
+      r = rand();
+      if(extras >= 1 && r < 0.04)
+        s = "M" substr(modes, int(rand() * 3) + 1, 1);
+      else if(extras >= 2 && r < 0.07)
+        s = "X" names[int(rand() * 4) + 1] ((rand() < 0.3) ? "*" int(rand() * 5) : "") ";";
+      else if(r < 0.5)
+        s = substr(notes, int(rand() * 7) + 1, 1);
+      else if(r < 0.7 || !noise)
+        s = substr(commands, int(rand() * 4) + 1, 1) int(rand() * 300);
+      else
+        s = substr(symbols, int(rand() * length(symbols)) + 1, 1);
+      printf "%s", s;
+      n += length(s);
+    }
+  }'
+}
+
+# seed:extras; odd seeds are noisy
+for test in 1:0 2:0 3:0 4:0 9:0 11:0 5:1 6:1 7:2 8:2; do
+  seed=${test%:*}
+  extras=${test#*:}
+  noise=$((seed % 2))
+  if ! generate $seed 1200000 $noise $extras > "$WORK/play.txt" || [ ! -s "$WORK/play.txt" ]; then
+    echo "FAIL: could not generate statement $seed"
+    exit 1
+  fi
+  "$BASICPLAY" "$WORK/play.txt" $SUBSTRINGS -j 1 -maxerrors 0 -f -o "$WORK/serial.bps" 2> "$WORK/serial.err"
+  for threads in 2 3 4 6 8 16; do
+    "$BASICPLAY" "$WORK/play.txt" $SUBSTRINGS -j $threads -maxerrors 0 -f -o "$WORK/parallel.bps" 2> "$WORK/parallel.err"
+    if ! cmp -s "$WORK/serial.bps" "$WORK/parallel.bps"; then
+      echo "FAIL: statement $seed parsed with -j $threads gives a different song"
+      FAILED=1
+    fi
+    if ! cmp -s "$WORK/serial.err" "$WORK/parallel.err"; then
+      echo "FAIL: statement $seed parsed with -j $threads gives different syntax errors"
+      FAILED=1
+    fi
+  done
+done
+
+[ $FAILED -eq 0 ] && echo "parallel parsing: ok"
+exit $FAILED
@@ -0,0 +1,123 @@
+#!/bin/sh
+# Checks the headers of WAVE files around the 4 GB limit of RIFF: a
+# song too long for RIFF is written as RF64, with its 32-bit sizes set
+# to 0xffffffff and its real sizes in the ds64 chunk, whether it is
+# written to a file or streamed; the longest song that fits is still
+# plain RIFF.  The songs are almost all silence, which is left as holes
+# in the files, so they take up little disk space.
+#
+# usage: tests/rf64.sh [basicplay]
+
+BASICPLAY=${1:-./basicplay}
+WORK=${TMPDIR:-/tmp}/basicplay-rf64.$$
+FAILED=0
+
+# 51000 seconds of silence followed by three notes
+SONG='T255 XS*12000; L4 CDE'
+PAUSE='-xS=P1'
+
+mkdir -p "$WORK" || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+# prints the little-endian number of $3 bytes at offset $2 of file $1
+number()
+{
+  od -An -tu1 -j "$2" -N "$3" "$1" | awk '{ for(i = 1; i <= NF; i++) b[n++] = $i }
+    END { v = 0; for(i = n - 1; i >= 0; i--) v = v * 256 + b[i]; printf "%.0f\n", v }'
+}
+
+# prints the $3 bytes at offset $2 of file $1 as text
+text()
+{
+  dd if="$1" bs=1 skip="$2" count="$3" 2>/dev/null
+}
+
+# expect description actual expected
+expect()
+{
+  if [ "$2" != "$3" ]; then
+    echo "$1: $2, expected $3" >&2
+    FAILED=1
+  fi
+}
+
+# runs basicplay, which exits with 1 once it has written its output
+render()
+{
+  "$BASICPLAY" "$@"
+  if [ $? -ne 1 ]; then
+    echo "rf64: basicplay $* failed" >&2
+    FAILED=1
+  fi
+}
+
+# checks that file $1 holds an RF64 header for $2 samples
+checkRF64()
+{
+  size=$(wc -c < "$1" | tr -d ' ')
+  expect "$1 form" "$(text "$1" 0 4)" RF64
+  expect "$1 RIFF size" "$(number "$1" 4 4)" 4294967295
+  expect "$1 type" "$(text "$1" 8 4)" WAVE
+  expect "$1 ds64 chunk" "$(text "$1" 12 4)" ds64
+  expect "$1 ds64 size" "$(number "$1" 16 4)" 28
+  expect "$1 ds64 RIFF size" "$(number "$1" 20 8)" $((size - 8))
+  expect "$1 ds64 data size" "$(number "$1" 28 8)" $((2 * $2))
+  expect "$1 ds64 sample count" "$(number "$1" 36 8)" "$2"
+  expect "$1 fmt chunk" "$(text "$1" 48 4)" "fmt "
+  expect "$1 data chunk" "$(text "$1" 72 4)" data
+  expect "$1 data size" "$(number "$1" 76 4)" 4294967295
+}
+
+# checks that file $1 holds a plain RIFF header for $2 samples
+checkRIFF()
+{
+  size=$(wc -c < "$1" | tr -d ' ')
+  expect "$1 form" "$(text "$1" 0 4)" RIFF
+  expect "$1 RIFF size" "$(number "$1" 4 4)" $((size - 8))
+  expect "$1 type" "$(text "$1" 8 4)" WAVE
+  expect "$1 fmt chunk" "$(text "$1" 12 4)" "fmt "
+  expect "$1 data chunk" "$(text "$1" 36 4)" data
+  expect "$1 data size" "$(number "$1" 40 4)" $((2 * $2))
+}
+
+samples=$("$BASICPLAY" -estimate -e "$SONG" $PAUSE -wav "$WORK/long.wav" 2>&1 |
+          sed -n 's/.*(\([0-9]*\) samples).*/\1/p')
+if [ -z "$samples" ]; then
+  echo "rf64: could not estimate the length of the song" >&2
+  exit 1
+fi
+
+# the whole song, rendered to a file
+render -e "$SONG" $PAUSE -wav "$WORK/long.wav"
+expect "long.wav size" "$(wc -c < "$WORK/long.wav" | tr -d ' ')" $((80 + 2 * samples))
+if [ "$(du -k "$WORK/long.wav" | cut -f1)" -gt 1048576 ]; then
+  echo "rf64: $WORK does not keep sparse files, so the rest is skipped" >&2
+  exit $FAILED
+fi
+checkRF64 "$WORK/long.wav" "$samples"
+
+# the same song streamed; only its header is read
+"$BASICPLAY" -e "$SONG" $PAUSE -wav -c 2>/dev/null | head -c 80 > "$WORK/stream.wav"
+text "$WORK/long.wav" 0 80 | cmp -s - "$WORK/stream.wav" || {
+  echo "rf64: the streamed header differs from the file's" >&2
+  FAILED=1
+}
+rm -f "$WORK/long.wav"
+
+# the most samples a RIFF file can hold: 2 * 2147483629 + 36 bytes
+# after its size field is 0xfffffffe
+render -maxbytes 4294967302 -truncate -e "$SONG" $PAUSE -wav "$WORK/riff.wav"
+expect "riff.wav size" "$(wc -c < "$WORK/riff.wav" | tr -d ' ')" 4294967302
+checkRIFF "$WORK/riff.wav" 2147483629
+rm -f "$WORK/riff.wav"
+
+# one sample more needs RF64
+render -maxbytes 4294967340 -truncate -e "$SONG" $PAUSE -wav "$WORK/rf64.wav"
+expect "rf64.wav size" "$(wc -c < "$WORK/rf64.wav" | tr -d ' ')" 4294967340
+checkRF64 "$WORK/rf64.wav" 2147483630
+rm -f "$WORK/rf64.wav"
+
+if [ $FAILED -eq 0 ]; then
+  echo "RF64 headers: ok"
+fi
+exit $FAILED